@@ -25,22 +25,373 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <limits.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#else
+#include <direct.h>
+#endif
 
 #include "meflib.h"
+#include "mef3_tools.h"
 
 MEF_GLOBALS	*MEF_globals;
 
+// Upper bound on the data read buffer.  blocks_per_read is reduced so that one read never exceeds this.
+#define MAX_READ_BUFFER_BYTES   (16 * 1024 * 1024)
 
-int validate_mef3(char *channelname, char *log_filename, char *password)
+// Data read buffer, reused across channels so that validating many channels does not grow memory.
+static ui1 *read_buffer = NULL;
+static ui8 read_buffer_bytes = 0;
+
+// validate_mef3_segments() result when the check could not be carried out, as opposed to a count of errors found
+#define VALIDATE_NOT_CHECKED    (-1)
+
+// Job mode validates one segment at a time, so the most recent channel is kept open for the next unit.  A channel that
+// could not be read when the job was made is one unit covering all its segments.
+#define JOB_WHOLE_CHANNEL       (-1)
+static si4 cache_channels = 0;
+static CHANNEL *cached_channel = NULL;
+static si1 cached_channel_name[MEF_FULL_FILE_NAME_BYTES];
+
+// --sample mode: fraction of data blocks to CRC check (0 = check every block), optional per-channel and whole-run
+// time budgets
+#define DEFAULT_SAMPLE_FRACTION 0.01
+#define SAMPLE_ROUNDS           8
+static sf8 sample_fraction = 0.0;
+static sf8 sample_budget_seconds = 0.0;
+static sf8 sample_total_budget_seconds = 0.0;
+static ui8 sample_seed = 0;
+static time_t sample_run_start;
+static si4 sample_channels_expected = 0;
+
+// --sample totals over every channel (or job unit) checked so far in this process
+static si4 sample_channels_done = 0;
+static si8 sample_total_blocks = 0;
+static si8 sample_total_checked = 0;
+static si8 sample_total_bad = 0;
+static si8 sample_total_unreadable = 0;
+
+typedef struct {
+    ui4 round;
+    si4 segment;
+    si8 block;
+    si8 file_offset;
+} SAMPLED_BLOCK;
+
+static ui8 sample_rng_state;
+
+// xorshift64*, so samples are reproducible from the printed seed on every platform
+ui8 sample_random(ui8 n)
+{
+    sample_rng_state ^= sample_rng_state >> 12;
+    sample_rng_state ^= sample_rng_state << 25;
+    sample_rng_state ^= sample_rng_state >> 27;
+    return((sample_rng_state * 0x2545F4914F6CDD1DULL) % n);
+}
+
+int compare_sampled_blocks(const void *a, const void *b)
+{
+    const SAMPLED_BLOCK *sa = (const SAMPLED_BLOCK *) a;
+    const SAMPLED_BLOCK *sb = (const SAMPLED_BLOCK *) b;
+    
+    if (sa->round != sb->round) return(sa->round < sb->round ? -1 : 1);
+    if (sa->segment != sb->segment) return(sa->segment < sb->segment ? -1 : 1);
+    if (sa->file_offset != sb->file_offset) return(sa->file_offset < sb->file_offset ? -1 : 1);
+    return(0);
+}
+
+// One-sided 95% upper bound on the block corruption rate from n_bad failures among n_checked sampled blocks: exact
+// binomial bound when nothing failed, Wilson score bound otherwise.
+sf8 sample_upper_bound(si8 n_checked, si8 n_bad)
+{
+    sf8 z, p_hat, centre, margin;
+    
+    z = 1.645;
+    if (n_checked == 0)
+        return(1.0);
+    if (n_bad == 0)
+        return(1.0 - pow(0.05, 1.0 / n_checked));
+    p_hat = (sf8) n_bad / n_checked;
+    centre = p_hat + z * z / (2.0 * n_checked);
+    margin = z * sqrt(p_hat * (1.0 - p_hat) / n_checked + z * z / (4.0 * n_checked * n_checked));
+    return((centre + margin) / (1.0 + z * z / n_checked));
+}
+
+// Format the sampled check result for total_blocks blocks, of which n_unreadable lie in segments whose data file
+// could not be opened; the bound only covers the others.
+void format_sample_result(char *message, char *label, si8 total_blocks, si8 n_checked, si8 n_bad, si8 n_unreadable)
+{
+    sf8 upper_bound;
+    si8 covered_blocks;
+    
+    upper_bound = sample_upper_bound(n_checked, n_bad);
+    covered_blocks = total_blocks - n_unreadable;
+    message += sprintf(message, "%s sampled check: %ld of %ld blocks checked (%.4f%%), %ld bad; 95%% upper bound on block corruption rate %.6f (about %.0f blocks)",
+                       label, n_checked, covered_blocks, covered_blocks ? 100.0 * n_checked / covered_blocks : 0.0, n_bad,
+                       upper_bound, upper_bound * covered_blocks);
+    if (n_unreadable)
+        message += sprintf(message, "; %ld more blocks are in data files that could not be opened and were not checked", n_unreadable);
+    sprintf(message, "\n");
+}
+
+// Time budget for sampling one channel of total_blocks blocks.  With --total-budget the channel gets a share of the
+// time left in proportion to its size, so every channel ends up sampled at about the same fraction and the totals
+// stay a fair sample of the whole run.  Channels still to come are assumed to be the size of the average so far.
+sf8 channel_sample_budget(si8 total_blocks)
+{
+    sf8 budget, share, remaining_time;
+    si8 channels_after, average_blocks;
+    
+    budget = sample_budget_seconds;
+    if (sample_total_budget_seconds > 0.0) {
+        remaining_time = sample_total_budget_seconds - difftime(time(NULL), sample_run_start);
+        channels_after = sample_channels_expected - sample_channels_done - 1;
+        if (channels_after < 0)
+            channels_after = 0;
+        average_blocks = sample_channels_done ? sample_total_blocks / sample_channels_done : total_blocks;
+        if (total_blocks + average_blocks * channels_after > 0)
+            share = remaining_time * total_blocks / (total_blocks + average_blocks * channels_after);
+        else
+            share = remaining_time;
+        // once the time is used up, each remaining channel still gets its first round
+        if (share < 0.001)
+            share = 0.001;
+        if (budget <= 0.0 || share < budget)
+            budget = share;
+    }
+    return(budget);
+}
+
+// CRC check a stratified random subset of data blocks.  Each segment is cut into strata of 1/sample_fraction
+// blocks and one block is drawn from each stratum.  Strata are dealt into SAMPLE_ROUNDS rounds so that a time
+// budget that runs out early still leaves a sample spread over the whole channel.  Within a round, reads are
+// sorted by segment and file offset.  A segment whose data file cannot be opened counts as one error and its blocks
+// are reported as not checked.  Returns the number of errors found.
+ui8 check_sampled_blocks(CHANNEL *channel, char *channelname, FILE *lfp, si4 first_segment, si4 end_segment)
 {
-    int i, blocks_per_read;
+    si4 seg, current_seg, rounds;
+    si8 i, k, number_of_blocks, stratum, n_strata, n_sampled, n_checked, n_bad, n_unreadable, total_blocks, block_size;
+    si8 block_time, segment_time;
+    ui8 num_errors;
+    time_t start;
+    char message[1024];
+    sf8 budget;
+    ui1 *segment_unreadable;
+    SAMPLED_BLOCK *samples;
+    TIME_SERIES_INDEX *tsi;
+    FILE_PROCESSING_STRUCT *tdat;
+    RED_BLOCK_HEADER *block_header;
+    
+    num_errors = 0;
+    stratum = (si8) (1.0 / sample_fraction + 0.5);
+    if (stratum < 1)
+        stratum = 1;
+    
+    total_blocks = n_strata = 0;
+    for (seg = first_segment; seg < end_segment; seg++) {
+        number_of_blocks = channel->segments[seg].time_series_indices_fps->universal_header->number_of_entries;
+        total_blocks += number_of_blocks;
+        n_strata += (number_of_blocks + stratum - 1) / stratum;
+    }
+    budget = channel_sample_budget(total_blocks);
+    rounds = (budget > 0.0) ? SAMPLE_ROUNDS : 1;
+    
+    samples = (SAMPLED_BLOCK *) calloc((size_t) n_strata + 1, sizeof(SAMPLED_BLOCK));
+    segment_unreadable = (ui1 *) calloc((size_t) end_segment + 1, sizeof(ui1));
+    if (samples == NULL || segment_unreadable == NULL) {
+        fprintf(stdout, "[%s] Error allocating sample list for %s\n", __FUNCTION__, channelname);
+        free(samples);
+        free(segment_unreadable);
+        return(1);
+    }
+    
+    n_sampled = 0;
+    for (seg = first_segment; seg < end_segment; seg++) {
+        number_of_blocks = channel->segments[seg].time_series_indices_fps->universal_header->number_of_entries;
+        for (k = 0; k * stratum < number_of_blocks; k++) {
+            i = k * stratum + (si8) sample_random((ui8) ((k + 1) * stratum > number_of_blocks ? number_of_blocks - k * stratum : stratum));
+            samples[n_sampled].round = (ui4) (n_sampled % rounds);
+            samples[n_sampled].segment = seg;
+            samples[n_sampled].block = i;
+            samples[n_sampled].file_offset = channel->segments[seg].time_series_indices_fps->time_series_indices[i].file_offset;
+            n_sampled++;
+        }
+    }
+    qsort(samples, (size_t) n_sampled, sizeof(SAMPLED_BLOCK), compare_sampled_blocks);
+    
+    fprintf(stdout, "- Sampling %ld of %ld data blocks\n", n_sampled, total_blocks);
+    
+    start = time(NULL);
+    current_seg = -1;
+    tdat = NULL;
+    n_checked = n_bad = n_unreadable = 0;
+    for (k = 0; k < n_sampled; k++) {
+        
+        // the budget is only checked between rounds, so every finished round is an unbiased sample
+        if (k > 0 && samples[k].round != samples[k-1].round && budget > 0.0 &&
+            difftime(time(NULL), start) >= budget)
+            break;
+        
+        seg = samples[k].segment;
+        i = samples[k].block;
+        if (segment_unreadable[seg])
+            continue;
+        if (seg != current_seg) {
+            if (tdat != NULL && tdat->fp != NULL) {
+                fclose(tdat->fp);
+                tdat->fp = NULL;
+            }
+            current_seg = seg;
+            tdat = channel->segments[seg].time_series_data_fps;
+            if (tdat->fp == NULL)
+                tdat->fp = fopen(tdat->full_file_name, "rb");
+            if (tdat->fp == NULL) {
+                segment_unreadable[seg] = 1;
+                number_of_blocks = channel->segments[seg].time_series_indices_fps->universal_header->number_of_entries;
+                n_unreadable += number_of_blocks;
+                num_errors++;
+                sprintf(message, "Unable to open data file %s, its %ld blocks are not checked\n", tdat->full_file_name, number_of_blocks);
+                fprintf(stdout, "%s", message);
+                if (lfp != NULL) fprintf(lfp, "%s", message);
+                continue;
+            }
+        }
+        
+        tsi = channel->segments[seg].time_series_indices_fps->time_series_indices;
+        number_of_blocks = channel->segments[seg].time_series_indices_fps->universal_header->number_of_entries;
+        if (i < number_of_blocks - 1)
+            block_size = tsi[i+1].file_offset - tsi[i].file_offset;
+        else
+            block_size = tdat->file_length - tsi[i].file_offset;
+        
+        n_checked++;
+        
+        if (block_size < RED_BLOCK_HEADER_BYTES || (ui8) block_size > read_buffer_bytes) {
+            n_bad++; num_errors++;
+            sprintf(message, "Block %ld has invalid size %ld from index array, in segment %s\n", i, block_size, channel->segments[seg].name);
+            fprintf(stdout, "%s", message);
+            if (lfp != NULL) fprintf(lfp, "%s", message);
+            continue;
+        }
+        
+#ifndef _WIN32
+        fseek(tdat->fp, tsi[i].file_offset, SEEK_SET);
+#else
+        _fseeki64(tdat->fp, tsi[i].file_offset, SEEK_SET);
+#endif
+        if (fread(read_buffer, 1, (size_t) block_size, tdat->fp) != (size_t) block_size) {
+            n_bad++; num_errors++;
+            sprintf(message, "Error reading block %ld in segment %s\n", i, channel->segments[seg].name);
+            fprintf(stdout, "%s", message);
+            if (lfp != NULL) fprintf(lfp, "%s", message);
+            continue;
+        }
+        
+        block_header = (RED_BLOCK_HEADER *) read_buffer;
+        if (block_header->block_bytes != block_size) {
+            n_bad++; num_errors++;
+            sprintf(message, "Block %ld size %u disagrees with index array offset %ld, in segment %s\n", i,
+                    block_header->block_bytes, block_size, channel->segments[seg].name);
+            fprintf(stdout, "%s", message);
+            if (lfp != NULL) fprintf(lfp, "%s", message);
+        }
+        else if (CRC_calculate((ui1 *) block_header + CRC_BYTES, block_header->block_bytes - CRC_BYTES) != block_header->block_CRC) {
+            n_bad++; num_errors++;
+            sprintf(message, "**CRC error in block %ld in segment %s\n", i, channel->segments[seg].name);
+            fprintf(stdout, "%s", message);
+            if (lfp != NULL) fprintf(lfp, "%s", message);
+        }
+        
+        // the same block header time checks as the full data sweep
+        block_time = block_header->start_time;
+        remove_recording_time_offset(&block_time);
+        
+        if (tsi[i].start_time != block_time) {
+            num_errors++;
+            sprintf(message, "Block %ld start_time does not match index start_time in segment %s\n", i, channel->segments[seg].name);
+            fprintf(stdout, "%s", message);
+            if (lfp != NULL) fprintf(lfp, "%s", message);
+        }
+        
+        segment_time = channel->segments[seg].metadata_fps->universal_header->start_time;
+        remove_recording_time_offset(&segment_time);
+        if (block_time < segment_time) {
+            num_errors++;
+            sprintf(message, "Block %ld start time %ld is earlier than segment start time in segment %s\n", i, block_time, channel->segments[seg].name);
+            fprintf(stdout, "%s", message);
+            if (lfp != NULL) fprintf(lfp, "%s", message);
+        }
+        
+        segment_time = channel->segments[seg].metadata_fps->universal_header->end_time;
+        remove_recording_time_offset(&segment_time);
+        if (block_time > segment_time) {
+            num_errors++;
+            sprintf(message, "Block %ld start time %ld is later than segment end time in segment %s\n", i, block_time, channel->segments[seg].name);
+            fprintf(stdout, "%s", message);
+            if (lfp != NULL) fprintf(lfp, "%s", message);
+        }
+    }
+    
+    if (tdat != NULL && tdat->fp != NULL) {
+        fclose(tdat->fp);
+        tdat->fp = NULL;
+    }
+    free(samples);
+    free(segment_unreadable);
+    
+    format_sample_result(message, channelname, total_blocks, n_checked, n_bad, n_unreadable);
+    fprintf(stdout, "%s", message);
+    if (lfp != NULL) fprintf(lfp, "%s", message);
+    
+    sample_channels_done++;
+    sample_total_blocks += total_blocks;
+    sample_total_checked += n_checked;
+    sample_total_bad += n_bad;
+    sample_total_unreadable += n_unreadable;
+    
+    return(num_errors);
+}
+
+
+// free a channel, or keep it for the next call when job mode is caching channels
+void release_channel(CHANNEL *channel, char *channelname)
+{
+    if (cache_channels) {
+        cached_channel = channel;
+        strncpy(cached_channel_name, channelname, MEF_FULL_FILE_NAME_BYTES - 1);
+        cached_channel_name[MEF_FULL_FILE_NAME_BYTES - 1] = 0;
+    }
+    else
+        free_channel(channel, MEF_TRUE);
+}
+
+void free_cached_channel()
+{
+    if (cached_channel != NULL)
+        free_channel(cached_channel, MEF_TRUE);
+    cached_channel = NULL;
+    *cached_channel_name = 0;
+}
+
+// Validate segments [first_segment, end_segment) of a channel; end_segment < 0 means through the last segment.
+// Channel-level checks run only when the range starts at segment 0.  Returns the number of errors found, or
+// VALIDATE_NOT_CHECKED if the channel could not be checked at all (unreadable, missing segment, read error).
+int validate_mef3_segments(char *channelname, char *log_filename, char *password, si4 first_segment, si4 end_segment)
+{
+    int i, blocks_per_read, segment_blocks_per_read;
     ui1 logfile, bad_index;
     ui8 num_errors;
     ui8 errors_before_this_segment;
     CHANNEL *channel;
     FILE *lfp;
     si4 start_segment, numSegments;
-    char message[200], *time_str;
+    char message[1024], *time_str;
     time_t now;
     si4 numBlocks;
     si8 temp_time, temp_time2;
@@ -49,7 +400,8 @@ int validate_mef3(char *channelname, char *log_filename, char *password)
     si4 n_read;
     ui1 in_data;
     RED_PROCESSING_STRUCT *rps;
-    si4 *data;
+    ui1 *data;
+    ui8 bytes_needed;
     si8 calc_end_time;
     si8 offset;
     si8 dt, ds;
@@ -64,14 +416,13 @@ int validate_mef3(char *channelname, char *log_filename, char *password)
     
     MEF_globals->CRC_mode = 2;
     
-    blocks_per_read = 300;
     num_errors = 0;
     bad_index = 0;
     
     
     if (channelname == NULL) {
         fprintf(stdout, "[%s] Error: NULL mef filename pointer passed in\n", __FUNCTION__);
-        return(1);
+        return(VALIDATE_NOT_CHECKED);
     }
     
     //NULL or empty log_filename directs output to stdout only
@@ -90,7 +441,7 @@ int validate_mef3(char *channelname, char *log_filename, char *password)
         lfp = fopen(log_filename, "a+");
         if (lfp == NULL) {
             fprintf(stdout, "[%s] Error opening %s for writing\n", __FUNCTION__, log_filename);
-            return(1);
+            return(VALIDATE_NOT_CHECKED);
         }
     }
     
@@ -103,10 +454,24 @@ int validate_mef3(char *channelname, char *log_filename, char *password)
     
     fprintf(stdout, "\n- Checking header CRCs for all files, and body CRCs for metadata and index files:\n\n");
     
-    if (password == NULL)
-        channel = read_MEF_channel(NULL, channelname, TIME_SERIES_CHANNEL_TYPE, NULL, NULL, MEF_FALSE, MEF_FALSE);
-    else
-        channel = read_MEF_channel(NULL, channelname, TIME_SERIES_CHANNEL_TYPE, password, NULL, MEF_FALSE, MEF_FALSE);
+    if (cached_channel != NULL && strcmp(cached_channel_name, channelname) == 0) {
+        channel = cached_channel;
+        cached_channel = NULL;
+    }
+    else {
+        free_cached_channel();
+        if (password == NULL)
+            channel = read_MEF_channel(NULL, channelname, TIME_SERIES_CHANNEL_TYPE, NULL, NULL, MEF_FALSE, MEF_FALSE);
+        else
+            channel = read_MEF_channel(NULL, channelname, TIME_SERIES_CHANNEL_TYPE, password, NULL, MEF_FALSE, MEF_FALSE);
+    }
+    
+    if (channel == NULL)
+    {
+        fprintf(stdout, "[%s] Error with read_MEF_channel() for %s, returned NULL\n", __FUNCTION__, channelname);
+        if (logfile) fclose(lfp);
+        return(VALIDATE_NOT_CHECKED);
+    }
     
     //fprintf(stdout, " number of blocks = %ld\n", channel->segments[1].time_series_indices_fps->universal_header->number_of_entries);
     //fprintf(stdout, " number of blocks = %ld\n",  channel->segments[1].metadata_fps->metadata.time_series_section_2->number_of_blocks);
@@ -123,52 +488,77 @@ int validate_mef3(char *channelname, char *log_filename, char *password)
         channel->metadata.time_series_section_2->block_interval = (1e6 / channel->metadata.time_series_section_2->sampling_frequency) * channel->metadata.time_series_section_2->maximum_block_samples;
     }
 
-    data = calloc(channel->metadata.time_series_section_2->sampling_frequency * (channel->metadata.time_series_section_2->block_interval / 1e6), blocks_per_read * 10);
-    //fprintf(stdout, "allocating: %f\n", channel->metadata.time_series_section_2->sampling_frequency * blocks_per_read * 10);
-    
-    if (channel == NULL)
-    {
-        fprintf(stdout, "[%s] Error with read_MEF_channel() for %s, returned NULL\n", __FUNCTION__, channelname);
-        return(1);
+    // size reads by the largest block in the channel, capped so the buffer stays bounded
+    blocks_per_read = 300;
+    if (channel->metadata.time_series_section_2->maximum_block_bytes > 0 &&
+        blocks_per_read * channel->metadata.time_series_section_2->maximum_block_bytes > MAX_READ_BUFFER_BYTES)
+        blocks_per_read = MAX_READ_BUFFER_BYTES / channel->metadata.time_series_section_2->maximum_block_bytes;
+    if (blocks_per_read < 1)
+        blocks_per_read = 1;
+    bytes_needed = (ui8) blocks_per_read * channel->metadata.time_series_section_2->maximum_block_bytes;
+    if (bytes_needed > read_buffer_bytes) {
+        data = realloc(read_buffer, bytes_needed);
+        if (data == NULL) {
+            fprintf(stdout, "[%s] Error allocating %lu byte read buffer for %s\n", __FUNCTION__, bytes_needed, channelname);
+            release_channel(channel, channelname);
+            if (logfile) fclose(lfp);
+            return(VALIDATE_NOT_CHECKED);
+        }
+        read_buffer = data;
+        read_buffer_bytes = bytes_needed;
     }
+    data = read_buffer;
 
     
     //// Begin checking mef file ///
     //Check header recording times against index array
-    temp_time = channel->segments[0].metadata_fps->universal_header->start_time;
-    remove_recording_time_offset(&temp_time);
-    if (temp_time != channel->segments[0].time_series_indices_fps->time_series_indices[0].start_time) {
-        num_errors++;
-        sprintf(message, "Metadata header start_time %ld does not match index array time %ld\n",
-                channel->earliest_start_time,
-                channel->segments[0].time_series_indices_fps->time_series_indices[0].start_time);
-        fprintf(stdout, "%s", message);
-        if (logfile) fprintf(lfp, "%s", message);
-    }
-    
-    temp_time2 = channel->latest_end_time;
-    remove_recording_time_offset(&temp_time2);
-    
-    calc_end_time = temp_time +
-    (ui8)(0.5 + 1000000.0 * (sf8)channel->metadata.time_series_section_2->number_of_samples/channel->metadata.time_series_section_2->sampling_frequency);
-    
-    // give this test a 1 second tolerence, to prevent minor innacuracies from being flagged
-    if (temp_time2 < (calc_end_time - 1000000)) {
-        num_errors++;
+    if (first_segment == 0)
+    {
+        temp_time = channel->segments[0].metadata_fps->universal_header->start_time;
+        remove_recording_time_offset(&temp_time);
+        if (temp_time != channel->segments[0].time_series_indices_fps->time_series_indices[0].start_time) {
+            num_errors++;
+            sprintf(message, "Metadata header start_time %ld does not match index array time %ld\n",
+                    channel->earliest_start_time,
+                    channel->segments[0].time_series_indices_fps->time_series_indices[0].start_time);
+            fprintf(stdout, "%s", message);
+            if (logfile) fprintf(lfp, "%s", message);
+        }
         
-        sprintf(message, "Channel latest_end_time %ld does not match sampling freqency and number of samples\n",
-                temp_time2);
-        fprintf(stdout, "%s", message);
-        if (logfile) fprintf(lfp, "%s", message);
+        temp_time2 = channel->latest_end_time;
+        remove_recording_time_offset(&temp_time2);
+        
+        calc_end_time = temp_time +
+        (ui8)(0.5 + 1000000.0 * (sf8)channel->metadata.time_series_section_2->number_of_samples/channel->metadata.time_series_section_2->sampling_frequency);
+        
+        // give this test a 1 second tolerence, to prevent minor innacuracies from being flagged
+        if (temp_time2 < (calc_end_time - 1000000)) {
+            num_errors++;
+            
+            sprintf(message, "Channel latest_end_time %ld does not match sampling freqency and number of samples\n",
+                    temp_time2);
+            fprintf(stdout, "%s", message);
+            if (logfile) fprintf(lfp, "%s", message);
+        }
     }
     
     
     numSegments = channel->number_of_segments;
-    start_segment = 0;
+    if (end_segment >= 0 && end_segment < numSegments)
+        numSegments = end_segment;
+    start_segment = first_segment;
     
     
-    if (numSegments == 0)
-    {fprintf(stdout, "[%s] number of segments is zero, must have at least one segmnent for channel %s\n", __FUNCTION__, channelname); return(1); }
+    if (numSegments == 0 || first_segment >= numSegments)
+    {
+        if (numSegments == 0)
+            fprintf(stdout, "[%s] number of segments is zero, must have at least one segmnent for channel %s\n", __FUNCTION__, channelname);
+        else
+            fprintf(stdout, "[%s] segment %d does not exist in channel %s\n", __FUNCTION__, first_segment, channelname);
+        release_channel(channel, channelname);
+        if (logfile) fclose(lfp);
+        return(VALIDATE_NOT_CHECKED);
+    }
     
     fprintf(stdout, "\n");
     
@@ -296,6 +686,19 @@ int validate_mef3(char *channelname, char *log_filename, char *password)
             if (logfile) fprintf(lfp, "%s", message);
         }
         
+        // the data sweep checks alignment block by block; in sampling mode it only sees the sampled blocks, so every
+        // index entry is checked here instead
+        if (sample_fraction > 0.0) {
+            for (i = 0; i < channel->segments[start_segment].time_series_indices_fps->universal_header->number_of_entries; i++) {
+                if (channel->segments[start_segment].time_series_indices_fps->time_series_indices[i].file_offset % 8) {
+                    num_errors++;
+                    sprintf(message, "Block %d is not 8-byte boundary aligned in segment %s\n", i, channel->segments[start_segment].name);
+                    fprintf(stdout, "%s", message);
+                    if (logfile) fprintf(lfp, "%s", message);
+                }
+            }
+        }
+        
         start_segment++;
         
     }
@@ -303,10 +706,16 @@ int validate_mef3(char *channelname, char *log_filename, char *password)
     // create RED processing struct
     rps = (RED_PROCESSING_STRUCT *) calloc((size_t) 1, sizeof(RED_PROCESSING_STRUCT));
     
-    start_segment = 0;
+    start_segment = first_segment;
     
     fprintf(stdout, "\n");
     
+    // in sampling mode a stratified subset of blocks replaces the full data sweep below
+    if (sample_fraction > 0.0) {
+        num_errors += check_sampled_blocks(channel, channelname, logfile ? lfp : NULL, first_segment, numSegments);
+        start_segment = numSegments;
+    }
+    
     // ************************
     // Iterate over segments, looping through data blocks
     // ************************
@@ -316,6 +725,21 @@ int validate_mef3(char *channelname, char *log_filename, char *password)
         
         if (channel->segments[start_segment].time_series_data_fps->fp == NULL) {
             channel->segments[start_segment].time_series_data_fps->fp = fopen(channel->segments[start_segment].time_series_data_fps->full_file_name, "rb");
+            if (channel->segments[start_segment].time_series_data_fps->fp == NULL) {
+                sprintf(message, "Error opening data file %s, channel not checked\n", channel->segments[start_segment].time_series_data_fps->full_file_name);
+                fprintf(stdout, "%s", message);
+                if (logfile) fprintf(lfp, "%s", message);
+                for (; start_segment < numSegments; start_segment++) {
+                    if (channel->segments[start_segment].time_series_data_fps->fp != NULL) {
+                        fclose(channel->segments[start_segment].time_series_data_fps->fp);
+                        channel->segments[start_segment].time_series_data_fps->fp = NULL;
+                    }
+                }
+                free(rps);
+                release_channel(channel, channelname);
+                if (logfile) fclose(lfp);
+                return(VALIDATE_NOT_CHECKED);
+            }
 #ifndef _WIN32
             channel->segments[start_segment].time_series_data_fps->fd = fileno(channel->segments[start_segment].time_series_data_fps->fp);
 #else
@@ -328,20 +752,34 @@ int validate_mef3(char *channelname, char *log_filename, char *password)
         errors_before_this_segment = num_errors;
         
         data_end = channel->segments[start_segment].time_series_indices_fps->time_series_indices[0].file_offset;
+        data_start = data_end;
+        n = 0;
         
         number_of_blocks = channel->segments[start_segment].time_series_indices_fps->universal_header->number_of_entries;
+        segment_blocks_per_read = blocks_per_read;
         
         
         //Loop through data blocks
         for (i=0; i<number_of_blocks; i++) {
             
             if(channel->segments[start_segment].time_series_indices_fps->time_series_indices[i].file_offset == data_end) { //read data
-                if (i + blocks_per_read >= number_of_blocks) {
-                    blocks_per_read = number_of_blocks - i;
+                if (i + segment_blocks_per_read >= number_of_blocks) {
+                    segment_blocks_per_read = number_of_blocks - i;
                     data_end = channel->segments[start_segment].time_series_data_fps->file_length;
                 }
                 else {
-                    data_end = channel->segments[start_segment].time_series_indices_fps->time_series_indices[blocks_per_read + i].file_offset;
+                    data_end = channel->segments[start_segment].time_series_indices_fps->time_series_indices[segment_blocks_per_read + i].file_offset;
+                }
+                
+                // a bad index can ask for more than the buffer holds; stop checking data in this segment
+                if (data_end < channel->segments[start_segment].time_series_indices_fps->time_series_indices[i].file_offset ||
+                    data_end - channel->segments[start_segment].time_series_indices_fps->time_series_indices[i].file_offset > read_buffer_bytes) {
+                    num_errors++;
+                    sprintf(message, "Block index offsets starting at block %d in segment %s span more than the read buffer, skipping rest of segment\n",
+                            i, channel->segments[start_segment].name);
+                    fprintf(stdout, "%s", message);
+                    if (logfile) fprintf(lfp, "%s", message);
+                    break;
                 }
                 
                 
@@ -361,13 +799,30 @@ int validate_mef3(char *channelname, char *log_filename, char *password)
                     ferror(channel->segments[start_segment].time_series_data_fps->fp)) {
                     fprintf(stdout, "n = %ld, data_end = %ld, offset = %ld\n", n, data_end, channel->segments[start_segment].time_series_indices_fps->time_series_indices[i].file_offset);
                     fprintf(stdout, "[%s] Error reading mef data %s\n", __FUNCTION__, channelname);
-                    fclose(lfp);
-                    return(1);
+                    for (; start_segment < numSegments; start_segment++) {
+                        if (channel->segments[start_segment].time_series_data_fps->fp != NULL) {
+                            fclose(channel->segments[start_segment].time_series_data_fps->fp);
+                            channel->segments[start_segment].time_series_data_fps->fp = NULL;
+                        }
+                    }
+                    free(rps);
+                    release_channel(channel, channelname);
+                    if (logfile) fclose(lfp);
+                    return(VALIDATE_NOT_CHECKED);
                 }
             }
             
             offset = channel->segments[start_segment].time_series_indices_fps->time_series_indices[i].file_offset - data_start;
             
+            // out-of-order index entries can point outside what was read
+            if (offset < 0 || offset + RED_BLOCK_HEADER_BYTES > n) {
+                num_errors++;
+                sprintf(message, "Block %d index offset lies outside the data read for it in segment %s\n", i, channel->segments[start_segment].name);
+                fprintf(stdout, "%s", message);
+                if (logfile) fprintf(lfp, "%s", message);
+                continue;
+            }
+            
             
             // cast block header
             rps->block_header = (RED_BLOCK_HEADER *) ((si1*)data + offset);
@@ -383,7 +838,7 @@ int validate_mef3(char *channelname, char *log_filename, char *password)
             
             
             // MEF 3: block_byte field in header now includes header and pad sizes
-            if ( abs(block_size - rps->block_header->block_bytes) > 0 )
+            if ( abs(block_size - rps->block_header->block_bytes) > 0 || offset + rps->block_header->block_bytes > n )
             {
                 num_errors++;
                 sprintf(message, "Block %d size %u disagrees with index array offset %u, in segment %s\n", i,
@@ -461,8 +916,10 @@ int validate_mef3(char *channelname, char *log_filename, char *password)
         //fprintf(stdout, "%s", message);
         if (logfile) fprintf(lfp, "%s", message);
 
-        if (channel->segments[start_segment].time_series_data_fps->fp != NULL)
+        if (channel->segments[start_segment].time_series_data_fps->fp != NULL) {
             fclose(channel->segments[start_segment].time_series_data_fps->fp);
+            channel->segments[start_segment].time_series_data_fps->fp = NULL;
+        }
         
         start_segment++;
     }
@@ -472,15 +929,587 @@ int validate_mef3(char *channelname, char *log_filename, char *password)
     fprintf(stdout, "%s", message);
     if (logfile) fprintf(lfp, "%s", message);
     
-    // TBD free memory
-    free(data); data = NULL;
+    // the read buffer is kept for the next channel; everything else is released
+    free(rps);
+    release_channel(channel, channelname);
     
     if (logfile) fclose(lfp);
     
-    return(num_errors);
+    return(num_errors > INT_MAX ? INT_MAX : (int) num_errors);
+    
+}
+
+int validate_mef3(char *channelname, char *log_filename, char *password)
+{
+    return(validate_mef3_segments(channelname, log_filename, password, 0, -1));
+}
+
+// ************************
+// Job mode.  A job directory holds a manifest with one work unit per channel segment.  Any number of check_mef3
+// processes, on one host or several sharing the filesystem, claim units by taking an fcntl() lock on the unit's
+// lock file; the lock is dropped automatically if a process dies.  A finished unit leaves a log and a .done
+// checkpoint, so a rerun skips it.  --merge combines the unit results into one report.  Claiming units needs
+// POSIX file locks, so --job is not available on Windows.
+// ************************
+
+void job_file_name(char *name, char *job_dir, si8 unit, char *extension)
+{
+    sprintf(name, "%s/unit_%08ld.%s", job_dir, unit, extension);
+}
+
+// parse one manifest line: unit<TAB>segment<TAB>channel
+int read_job_unit(FILE *mfp, si8 *unit, si4 *segment, char *channelname)
+{
+    char line[MEF_FULL_FILE_NAME_BYTES + 64], *p;
     
+    while (fgets(line, sizeof(line), mfp) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (*line == 0 || *line == '#')
+            continue;
+        if (sscanf(line, "%ld\t%d\t", unit, segment) != 2)
+            continue;
+        if ((p = strchr(line, '\t')) == NULL || (p = strchr(p + 1, '\t')) == NULL)
+            continue;
+        strcpy(channelname, p + 1);
+        return(1);
+    }
+    return(0);
+}
+
+// describe a unit's segment; JOB_WHOLE_CHANNEL units cover every segment
+void job_unit_label(char *label, si4 segment)
+{
+    if (segment == JOB_WHOLE_CHANNEL)
+        strcpy(label, "all segments");
+    else
+        sprintf(label, "segment %d", segment);
 }
 
+// Append one unit per segment of a channel to the manifest.  A channel that cannot be read now gets a single
+// JOB_WHOLE_CHANNEL unit instead, so --job retries it and --merge reports it rather than it dropping out of the job.
+// Returns 1 in that case.
+int add_job_units(FILE *mfp, char *channelname, char *password, si8 *next_unit)
+{
+    si4 i;
+    CHANNEL *channel;
+    
+    channel = read_MEF_channel(NULL, channelname, TIME_SERIES_CHANNEL_TYPE, password, NULL, MEF_FALSE, MEF_FALSE);
+    if (channel == NULL)
+    {
+        fprintf(stdout, "[%s] Error with read_MEF_channel() for %s, returned NULL; adding it as one whole-channel unit\n", __FUNCTION__, channelname);
+        fprintf(mfp, "%ld\t%d\t%s\n", (*next_unit)++, JOB_WHOLE_CHANNEL, channelname);
+        return(1);
+    }
+    
+    for (i = 0; i < channel->number_of_segments; i++)
+        fprintf(mfp, "%ld\t%d\t%s\n", (*next_unit)++, i, channelname);
+    
+    fprintf(stdout, "%s: %d units\n", channelname, channel->number_of_segments);
+    free_channel(channel, MEF_TRUE);
+    
+    return(0);
+}
+
+#ifndef _WIN32
+int run_job(char *job_dir, char *password)
+{
+    si4 segment, lock_fd, n_done, n_busy, n_skipped, n_failed, errors;
+    si8 unit, blocks_before, checked_before, bad_before, unreadable_before;
+    char manifest_name[MEF_FULL_FILE_NAME_BYTES], channelname[MEF_FULL_FILE_NAME_BYTES];
+    char lock_name[MEF_FULL_FILE_NAME_BYTES], log_name[MEF_FULL_FILE_NAME_BYTES];
+    char done_name[MEF_FULL_FILE_NAME_BYTES], temp_name[MEF_FULL_FILE_NAME_BYTES + 32], host[256], label[32];
+    struct flock fl;
+    FILE *mfp, *dfp;
+    
+    sprintf(manifest_name, "%s/manifest", job_dir);
+    mfp = fopen(manifest_name, "r");
+    if (mfp == NULL)
+    {
+        fprintf(stdout, "[%s] Error opening job manifest %s\n", __FUNCTION__, manifest_name);
+        return(1);
+    }
+    if (gethostname(host, sizeof(host)) != 0)
+        strcpy(host, "unknown");
+    host[sizeof(host) - 1] = 0;
+    
+    // consecutive units of the same channel reuse the channel read for the previous unit
+    cache_channels = 1;
+    n_done = n_busy = n_skipped = n_failed = 0;
+    
+    while (read_job_unit(mfp, &unit, &segment, channelname))
+    {
+        job_file_name(done_name, job_dir, unit, "done");
+        if (access(done_name, F_OK) == 0) {
+            n_skipped++;
+            continue;
+        }
+        
+        job_file_name(lock_name, job_dir, unit, "lock");
+        lock_fd = open(lock_name, O_RDWR | O_CREAT, 0666);
+        if (lock_fd < 0)
+        {
+            fprintf(stdout, "[%s] Error opening lock file %s\n", __FUNCTION__, lock_name);
+            continue;
+        }
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        if (fcntl(lock_fd, F_SETLK, &fl) == -1)
+        {
+            // another worker has this unit
+            close(lock_fd);
+            n_busy++;
+            continue;
+        }
+        // it may have been finished between the first check and taking the lock
+        if (access(done_name, F_OK) == 0)
+        {
+            close(lock_fd);
+            n_skipped++;
+            continue;
+        }
+        
+        // a unit interrupted part way is redone from the start of its segment
+        job_file_name(log_name, job_dir, unit, "log");
+        unlink(log_name);
+        
+        blocks_before = sample_total_blocks;
+        checked_before = sample_total_checked;
+        bad_before = sample_total_bad;
+        unreadable_before = sample_total_unreadable;
+        if (segment == JOB_WHOLE_CHANNEL)
+            errors = validate_mef3_segments(channelname, log_name, password, 0, -1);
+        else
+            errors = validate_mef3_segments(channelname, log_name, password, segment, segment + 1);
+        
+        // a unit that could not be checked (e.g. its filesystem is not mounted) gets no checkpoint, so it is retried
+        if (errors == VALIDATE_NOT_CHECKED)
+        {
+            job_unit_label(label, segment);
+            fprintf(stdout, "Unit %ld (%s %s) could not be checked, leaving it for a later run\n", unit, channelname, label);
+            n_failed++;
+            close(lock_fd);
+            continue;
+        }
+        
+        // checkpoint: write the result under a temporary name, then rename so .done is never seen half-written
+        sprintf(temp_name, "%s.%s.%d", done_name, host, (si4) getpid());
+        dfp = fopen(temp_name, "w");
+        if (dfp != NULL)
+        {
+            // the --sample counts of the unit follow, so --merge can bound the corruption rate of the whole job
+            fprintf(dfp, "%d\t%s\t%d\t%ld\t%ld\t%ld\t%ld\n", errors, host, (si4) getpid(),
+                    sample_total_blocks - blocks_before, sample_total_checked - checked_before,
+                    sample_total_bad - bad_before, sample_total_unreadable - unreadable_before);
+            fflush(dfp);
+            fsync(fileno(dfp));
+            fclose(dfp);
+            rename(temp_name, done_name);
+            n_done++;
+        }
+        else
+            fprintf(stdout, "[%s] Error writing checkpoint %s\n", __FUNCTION__, temp_name);
+        
+        close(lock_fd);
+    }
+    
+    fclose(mfp);
+    free_cached_channel();
+    cache_channels = 0;
+    
+    printf("Job %s: %d units completed by this process, %d could not be checked, %d already done, %d held by other workers\n",
+           job_dir, n_done, n_failed, n_skipped, n_busy);
+    
+    return(n_failed ? 1 : 0);
+}
+#endif
+
+int merge_job(char *job_dir)
+{
+    si4 segment, n_units, n_complete, n_channel_errors;
+    si8 unit, blocks, checked, bad, unreadable, total_blocks, total_checked, total_bad, total_unreadable;
+    ui8 errors, total_errors;
+    size_t n;
+    char manifest_name[MEF_FULL_FILE_NAME_BYTES], report_name[MEF_FULL_FILE_NAME_BYTES], channelname[MEF_FULL_FILE_NAME_BYTES];
+    char log_name[MEF_FULL_FILE_NAME_BYTES], done_name[MEF_FULL_FILE_NAME_BYTES], last_channel[MEF_FULL_FILE_NAME_BYTES];
+    char copy_buffer[4096], label[32];
+    FILE *mfp, *rfp, *fp;
+    
+    sprintf(manifest_name, "%s/manifest", job_dir);
+    sprintf(report_name, "%s/report.txt", job_dir);
+    mfp = fopen(manifest_name, "r");
+    if (mfp == NULL)
+    {
+        fprintf(stdout, "[%s] Error opening job manifest %s\n", __FUNCTION__, manifest_name);
+        return(1);
+    }
+    rfp = fopen(report_name, "w");
+    if (rfp == NULL)
+    {
+        fprintf(stdout, "[%s] Error opening %s for writing\n", __FUNCTION__, report_name);
+        fclose(mfp);
+        return(1);
+    }
+    
+    n_units = n_complete = n_channel_errors = 0;
+    total_errors = 0;
+    total_blocks = total_checked = total_bad = total_unreadable = 0;
+    *last_channel = 0;
+    
+    while (read_job_unit(mfp, &unit, &segment, channelname))
+    {
+        n_units++;
+        job_unit_label(label, segment);
+        job_file_name(done_name, job_dir, unit, "done");
+        fp = fopen(done_name, "r");
+        job_file_name(log_name, job_dir, unit, "log");
+        if (fp == NULL || fscanf(fp, "%lu", &errors) != 1)
+        {
+            if (fp != NULL) fclose(fp);
+            // a log without a checkpoint means a worker tried the unit and could not check it
+            fp = fopen(log_name, "r");
+            if (fp == NULL)
+            {
+                fprintf(rfp, "=== %s %s: NOT CHECKED (unit %ld incomplete)\n", channelname, label, unit);
+                continue;
+            }
+            fprintf(rfp, "=== %s %s: NOT CHECKED (unit %ld could not be checked)\n", channelname, label, unit);
+            while ((n = fread(copy_buffer, 1, sizeof(copy_buffer), fp)) > 0)
+                fwrite(copy_buffer, 1, n, rfp);
+            fclose(fp);
+            continue;
+        }
+        // units checked without --sample (or by an older check_mef3) carry no sample counts
+        if (fscanf(fp, "\t%*s\t%*d\t%ld\t%ld\t%ld\t%ld", &blocks, &checked, &bad, &unreadable) == 4)
+        {
+            total_blocks += blocks;
+            total_checked += checked;
+            total_bad += bad;
+            total_unreadable += unreadable;
+        }
+        fclose(fp);
+        n_complete++;
+        total_errors += errors;
+        if (errors && strcmp(last_channel, channelname) != 0)
+        {
+            n_channel_errors++;
+            strcpy(last_channel, channelname);
+        }
+        
+        fprintf(rfp, "=== %s %s: %lu errors\n", channelname, label, errors);
+        fp = fopen(log_name, "r");
+        if (fp != NULL)
+        {
+            while ((n = fread(copy_buffer, 1, sizeof(copy_buffer), fp)) > 0)
+                fwrite(copy_buffer, 1, n, rfp);
+            fclose(fp);
+        }
+    }
+    
+    sprintf(copy_buffer, "\nJob %s: %d of %d units checked, %d incomplete, %lu errors found, %d channels with errors.\n",
+            job_dir, n_complete, n_units, n_units - n_complete, total_errors, n_channel_errors);
+    fprintf(rfp, "%s", copy_buffer);
+    fprintf(stdout, "%s", copy_buffer);
+    if (total_checked > 0)
+    {
+        format_sample_result(copy_buffer, "Job", total_blocks, total_checked, total_bad, total_unreadable);
+        fprintf(rfp, "%s", copy_buffer);
+        fprintf(stdout, "%s", copy_buffer);
+    }
+    fprintf(stdout, "Report written to %s\n", report_name);
+    
+    fclose(rfp);
+    fclose(mfp);
+    
+    return(n_complete < n_units);
+}
+
+#ifndef _WIN32
+// ************************
+// Session mode.  Loads only metadata and time series indices for every channel of a session (read_MEF_channel
+// without time series data) and reports channels that disagree with the session majority on segment count,
+// sampling frequency, start and end times, segment boundaries, the start time of each segment's first indexed block
+// or duration.  No data blocks are read, although meflib still opens each .tdat for its universal header.  Channels
+// are read one at a time: meflib is not thread-safe, and reading them is nearly all of the work.
+// ************************
+
+typedef struct {
+    si1     name[MEF_FULL_FILE_NAME_BYTES];
+    si4     loaded;
+    si4     number_of_segments;
+    sf8     sampling_frequency;
+    si8     start_time;
+    si8     end_time;
+    si8     *segment_start_times;
+    si8     *segment_end_times;
+    si8     *segment_first_block_times;     // UUTC_NO_ENTRY for a segment without blocks
+} CHANNEL_SUMMARY;
+
+static CHANNEL_SUMMARY  *session_channels;
+static si4              session_number_of_channels;
+
+si4 summarize_channel(CHANNEL_SUMMARY *summary, si1 *password)
+{
+    si4 i;
+    si8 temp_time;
+    CHANNEL *channel;
+    SEGMENT *segment;
+    
+    channel = read_MEF_channel(NULL, summary->name, TIME_SERIES_CHANNEL_TYPE, password, NULL, MEF_FALSE, MEF_FALSE);
+    if (channel == NULL)
+    {
+        fprintf(stdout, "[%s] Error with read_MEF_channel() for %s, returned NULL\n", __FUNCTION__, summary->name);
+        return(1);
+    }
+    
+    summary->number_of_segments = channel->number_of_segments;
+    summary->sampling_frequency = channel->metadata.time_series_section_2->sampling_frequency;
+    summary->start_time = channel->earliest_start_time;
+    remove_recording_time_offset(&summary->start_time);
+    summary->end_time = channel->latest_end_time;
+    remove_recording_time_offset(&summary->end_time);
+    
+    summary->segment_start_times = (si8 *) calloc((size_t) channel->number_of_segments + 1, sizeof(si8));
+    summary->segment_end_times = (si8 *) calloc((size_t) channel->number_of_segments + 1, sizeof(si8));
+    summary->segment_first_block_times = (si8 *) calloc((size_t) channel->number_of_segments + 1, sizeof(si8));
+    for (i = 0; i < channel->number_of_segments; i++)
+    {
+        segment = &channel->segments[i];
+        temp_time = segment->metadata_fps->universal_header->start_time;
+        remove_recording_time_offset(&temp_time);
+        summary->segment_start_times[i] = temp_time;
+        temp_time = segment->metadata_fps->universal_header->end_time;
+        remove_recording_time_offset(&temp_time);
+        summary->segment_end_times[i] = temp_time;
+        if (segment->time_series_indices_fps->universal_header->number_of_entries > 0)
+        {
+            temp_time = segment->time_series_indices_fps->time_series_indices[0].start_time;
+            remove_recording_time_offset(&temp_time);
+            summary->segment_first_block_times[i] = temp_time;
+        }
+        else
+            summary->segment_first_block_times[i] = UUTC_NO_ENTRY;
+    }
+    summary->loaded = 1;
+    
+    free_channel(channel, MEF_TRUE);
+    
+    return(0);
+}
+
+int compare_si8(const void *a, const void *b)
+{
+    si8 x = *(const si8 *) a, y = *(const si8 *) b;
+    
+    return(x < y ? -1 : (x > y ? 1 : 0));
+}
+
+si8 median_si8(si8 *values, si4 n)
+{
+    qsort(values, (size_t) n, sizeof(si8), compare_si8);
+    return(values[n / 2]);
+}
+
+int validate_session(char *session_dir, char *password, sf8 tolerance_seconds)
+{
+    si4 i, j, k, n, n_loaded, n_inconsistent, deviant, majority_segments, best_count;
+    si8 tolerance, reference, value, *values;
+    sf8 majority_frequency;
+    DIR *dir;
+    struct dirent *entry;
+    CHANNEL_SUMMARY *c;
+    time_t start;
+    
+    dir = opendir(session_dir);
+    if (dir == NULL)
+    {
+        fprintf(stdout, "[%s] Error opening session %s\n", __FUNCTION__, session_dir);
+        return(1);
+    }
+    
+    // time series channels are the .timd directories in the session
+    n = 0;
+    while ((entry = readdir(dir)) != NULL)
+        if (strlen(entry->d_name) > 5 && strcmp(entry->d_name + strlen(entry->d_name) - 5, ".timd") == 0)
+            n++;
+    session_channels = (CHANNEL_SUMMARY *) calloc((size_t) n + 1, sizeof(CHANNEL_SUMMARY));
+    rewinddir(dir);
+    session_number_of_channels = 0;
+    while ((entry = readdir(dir)) != NULL && session_number_of_channels < n)
+        if (strlen(entry->d_name) > 5 && strcmp(entry->d_name + strlen(entry->d_name) - 5, ".timd") == 0)
+            snprintf(session_channels[session_number_of_channels++].name, MEF_FULL_FILE_NAME_BYTES, "%s/%s", session_dir, entry->d_name);
+    closedir(dir);
+    n = session_number_of_channels;
+    
+    if (n == 0)
+    {
+        fprintf(stdout, "[%s] No time series channels found in %s\n", __FUNCTION__, session_dir);
+        free(session_channels);
+        return(1);
+    }
+    
+    fprintf(stdout, "\nChecking consistency of %d channels in session %s\n", n, session_dir);
+    start = time(NULL);
+    
+    for (i = 0; i < n; i++)
+        summarize_channel(&session_channels[i], password);
+    
+    values = (si8 *) calloc((size_t) n, sizeof(si8));
+    tolerance = (si8) (tolerance_seconds * 1e6);
+    
+    // majority segment count and sampling frequency
+    majority_segments = 0;
+    majority_frequency = 0.0;
+    best_count = 0;
+    for (i = 0, n_loaded = 0; i < n; i++)
+    {
+        if (!session_channels[i].loaded)
+            continue;
+        n_loaded++;
+        for (j = 0, k = 0; j < n; j++)
+            if (session_channels[j].loaded && session_channels[j].number_of_segments == session_channels[i].number_of_segments)
+                k++;
+        if (k > best_count) {
+            best_count = k;
+            majority_segments = session_channels[i].number_of_segments;
+        }
+    }
+    best_count = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (!session_channels[i].loaded)
+            continue;
+        for (j = 0, k = 0; j < n; j++)
+            if (session_channels[j].loaded && session_channels[j].sampling_frequency == session_channels[i].sampling_frequency)
+                k++;
+        if (k > best_count) {
+            best_count = k;
+            majority_frequency = session_channels[i].sampling_frequency;
+        }
+    }
+    
+    fprintf(stdout, "Loaded %d of %d channels in %.0f s; majority: %d segments, %f Hz\n\n",
+            n_loaded, n, difftime(time(NULL), start), majority_segments, majority_frequency);
+    
+    n_inconsistent = n - n_loaded;
+    for (i = 0; i < n; i++)
+        if (!session_channels[i].loaded)
+            fprintf(stdout, "%s: could not be read\n", session_channels[i].name);
+    
+    for (i = 0; i < n; i++)
+    {
+        c = &session_channels[i];
+        if (!c->loaded)
+            continue;
+        deviant = 0;
+        
+        if (c->number_of_segments != majority_segments) {
+            fprintf(stdout, "%s: %d segments, session majority is %d\n", c->name, c->number_of_segments, majority_segments);
+            deviant = 1;
+        }
+        if (c->sampling_frequency != majority_frequency) {
+            fprintf(stdout, "%s: sampling frequency %f Hz, session majority is %f Hz\n", c->name, c->sampling_frequency, majority_frequency);
+            deviant = 1;
+        }
+        if (deviant) n_inconsistent++;
+    }
+    
+    // start time, end time and duration against the session median
+    for (k = 0; k < 3; k++)
+    {
+        for (i = 0, j = 0; i < n; i++)
+            if (session_channels[i].loaded)
+                values[j++] = (k == 0) ? session_channels[i].start_time :
+                              (k == 1) ? session_channels[i].end_time :
+                              session_channels[i].end_time - session_channels[i].start_time;
+        if (j == 0)
+            break;
+        reference = median_si8(values, j);
+        for (i = 0; i < n; i++)
+        {
+            c = &session_channels[i];
+            if (!c->loaded)
+                continue;
+            value = (k == 0) ? c->start_time : (k == 1) ? c->end_time : c->end_time - c->start_time;
+            if (llabs(value - reference) > tolerance)
+            {
+                fprintf(stdout, "%s: %s %ld differs from session median %ld by %.3f s\n", c->name,
+                        (k == 0) ? "start_time" : (k == 1) ? "end_time" : "duration",
+                        value, reference, (value - reference) / 1e6);
+                n_inconsistent++;
+            }
+        }
+    }
+    
+    // segment boundaries and first indexed block, segment by segment, among channels that have the segment
+    for (k = 0; k < majority_segments; k++)
+    {
+        for (j = 0; j < 3; j++)
+        {
+            for (i = 0, n_loaded = 0; i < n; i++)
+            {
+                c = &session_channels[i];
+                if (!c->loaded || k >= c->number_of_segments)
+                    continue;
+                value = (j == 0) ? c->segment_start_times[k] : (j == 1) ? c->segment_end_times[k] : c->segment_first_block_times[k];
+                if (value != UUTC_NO_ENTRY)
+                    values[n_loaded++] = value;
+            }
+            if (n_loaded == 0)
+                continue;
+            reference = median_si8(values, n_loaded);
+            for (i = 0; i < n; i++)
+            {
+                c = &session_channels[i];
+                if (!c->loaded || k >= c->number_of_segments)
+                    continue;
+                value = (j == 0) ? c->segment_start_times[k] : (j == 1) ? c->segment_end_times[k] : c->segment_first_block_times[k];
+                if (value == UUTC_NO_ENTRY)
+                    continue;
+                if (llabs(value - reference) > tolerance)
+                {
+                    fprintf(stdout, "%s: segment %d %s %ld differs from session median %ld by %.3f s\n", c->name, k,
+                            (j == 0) ? "start_time" : (j == 1) ? "end_time" : "first block start_time",
+                            value, reference, (value - reference) / 1e6);
+                    n_inconsistent++;
+                }
+            }
+        }
+    }
+    
+    fprintf(stdout, "\nDone checking session %s, %d inconsistencies found (tolerance %.3f s).\n\n", session_dir, n_inconsistent, tolerance_seconds);
+    
+    for (i = 0; i < n; i++)
+    {
+        free(session_channels[i].segment_start_times);
+        free(session_channels[i].segment_end_times);
+        free(session_channels[i].segment_first_block_times);
+    }
+    free(session_channels); session_channels = NULL;
+    free(values);
+    
+    return(n_inconsistent);
+}
+#endif
+
+#ifndef _WIN32
+void report_peak_rss()
+{
+    struct rusage usage;
+    
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return;
+    
+#ifdef __APPLE__
+    // macOS reports bytes, Linux reports kilobytes
+    printf("Peak RSS: %ld kB\n", (long) usage.ru_maxrss / 1024);
+#else
+    printf("Peak RSS: %ld kB\n", (long) usage.ru_maxrss);
+#endif
+}
+#endif
+
 int main (int argc, const char * argv[]) {
     si4 i,j,k,m, numBlocks, start_block;
     si4 *data;
@@ -489,7 +1518,17 @@ int main (int argc, const char * argv[]) {
     si4 numSegments, start_segment;
     si8 temp_time;
     si1 output_dir[1024];
-    si1 *password;
+    si1 *password, *list_file;
+    si1 line[MEF_FULL_FILE_NAME_BYTES];
+    si1 *make_job_dir, *job_dir, *merge_dir, *session_dir;
+    sf8 session_tolerance;
+    si1 manifest_name[MEF_FULL_FILE_NAME_BYTES];
+    si8 next_unit;
+    si4 n_unreadable;
+    FILE *list_fp, *job_mfp;
+    char message_buffer[1024];
+    char *channel_list_copy;
+    size_t n_list_bytes;
     
     CHANNEL    *channel;
     RED_PROCESSING_STRUCT	*rps;
@@ -500,14 +1539,22 @@ int main (int argc, const char * argv[]) {
     (void) initialize_meflib();
     
     password = NULL;
+    list_file = NULL;
+    make_job_dir = job_dir = merge_dir = session_dir = NULL;
+    session_tolerance = 1.0;
+    job_mfp = NULL;
+    next_unit = 0;
+    n_unreadable = 0;
     
     if (argc < 2)
     {
-        (void) printf("USAGE: %s chan_folder[s] [-p password]\n", argv[0]);
+        (void) printf("USAGE: %s chan_folder[s] [-p password] [-l channel_list_file] [--sample[=fraction]] [--budget=seconds] [--total-budget=seconds] [--seed=n]\n"
+                      "       %s --make-job=job_dir chan_folder[s] | --job=job_dir [-p password] | --merge=job_dir\n"
+                      "       %s --session=session_dir [-p password] [--tolerance=seconds]\n", argv[0], argv[0], argv[0]);
         return(1);
     }
     
-    // look for password
+    // look for password, channel list and sampling options
     i = 1;
     while (i < argc)
     {
@@ -515,25 +1562,187 @@ int main (int argc, const char * argv[]) {
             switch (argv[i][1])
             {
                 case 'p':
-                    if (i >= argc)
+                    if (i + 1 >= argc)
                     {
-                        (void) printf("USAGE: %s chan_folder[s] [-p password]\n", argv[0]);
+                        (void) printf("USAGE: %s chan_folder[s] [-p password] [-l channel_list_file]\n", argv[0]);
                         return(1);
                     }
                     password = argv[i+1];
                     i++;
                     break;
+                case 'l':
+                    if (i + 1 >= argc)
+                    {
+                        (void) printf("USAGE: %s chan_folder[s] [-p password] [-l channel_list_file]\n", argv[0]);
+                        return(1);
+                    }
+                    list_file = argv[i+1];
+                    i++;
+                    break;
+                case '-':
+                    if (strncmp(argv[i], "--sample", 8) == 0)
+                        sample_fraction = (argv[i][8] == '=') ? atof(argv[i] + 9) : DEFAULT_SAMPLE_FRACTION;
+                    else if (strncmp(argv[i], "--budget=", 9) == 0)
+                        sample_budget_seconds = atof(argv[i] + 9);
+                    else if (strncmp(argv[i], "--total-budget=", 15) == 0)
+                        sample_total_budget_seconds = atof(argv[i] + 15);
+                    else if (strncmp(argv[i], "--seed=", 7) == 0)
+                        sample_seed = strtoull(argv[i] + 7, NULL, 10);
+                    else if (strncmp(argv[i], "--make-job=", 11) == 0)
+                        make_job_dir = argv[i] + 11;
+                    else if (strncmp(argv[i], "--job=", 6) == 0)
+                        job_dir = argv[i] + 6;
+                    else if (strncmp(argv[i], "--merge=", 8) == 0)
+                        merge_dir = argv[i] + 8;
+                    else if (strncmp(argv[i], "--session=", 10) == 0)
+                        session_dir = argv[i] + 10;
+                    else if (strncmp(argv[i], "--tolerance=", 12) == 0)
+                        session_tolerance = atof(argv[i] + 12);
+                    break;
             }
         }
         i++;
     }
     
+    if (sample_fraction < 0.0 || sample_fraction > 1.0)
+    {
+        printf("Sample fraction must be between 0 and 1.\n");
+        return(1);
+    }
+    if (sample_fraction == 0.0 && (sample_budget_seconds > 0.0 || sample_total_budget_seconds > 0.0))
+        sample_fraction = DEFAULT_SAMPLE_FRACTION;
+    // a job's units are spread over processes that cannot share one clock; use --budget there
+    if (sample_total_budget_seconds > 0.0 && (job_dir != NULL || make_job_dir != NULL))
+    {
+        printf("--total-budget cannot be used with job mode; use --budget for a per-unit limit.\n");
+        return(1);
+    }
+    if (sample_fraction > 0.0)
+    {
+        if (sample_seed == 0)
+            sample_seed = (ui8) time(NULL);
+        sample_rng_state = sample_seed;
+        printf("Sampling %.4f%% of data blocks per channel, seed %lu\n", 100.0 * sample_fraction, sample_seed);
+    }
+    
+    if (merge_dir != NULL)
+        return(merge_job(merge_dir));
+    
+    if (session_dir != NULL)
+    {
+#ifndef _WIN32
+        i = validate_session(session_dir, password, session_tolerance);
+        report_peak_rss();
+        return(i ? 1 : 0);
+#else
+        printf("Session mode is not supported on Windows.\n");
+        return(1);
+#endif
+    }
+    
+    if (job_dir != NULL)
+    {
+#ifndef _WIN32
+        i = run_job(job_dir, password);
+        free(read_buffer); read_buffer = NULL; read_buffer_bytes = 0;
+        report_peak_rss();
+        return(i);
+#else
+        printf("Job mode is not supported on Windows.\n");
+        return(1);
+#endif
+    }
+    
+    // with --make-job the channels below are written to the manifest instead of being validated
+    if (make_job_dir != NULL)
+    {
+#ifndef _WIN32
+        mkdir(make_job_dir, 0777);
+#else
+        _mkdir(make_job_dir);
+#endif
+        sprintf(manifest_name, "%s/manifest", make_job_dir);
+        // units are numbered from 0, so .done and .log files left from an earlier job would be taken for this one's
+        job_mfp = fopen(manifest_name, "r");
+        if (job_mfp != NULL)
+        {
+            fclose(job_mfp);
+            printf("Job manifest %s already exists; use a new directory for a new job\n", manifest_name);
+            return(1);
+        }
+        job_mfp = fopen(manifest_name, "w");
+        if (job_mfp == NULL)
+        {
+            printf("Error creating job manifest %s\n", manifest_name);
+            return(1);
+        }
+        fprintf(job_mfp, "# check_mef3 job manifest: unit, segment (%d = whole channel), channel\n", JOB_WHOLE_CHANNEL);
+    }
+    
     if (argc > 1000)
     {
         printf("Too many folders specified!\n");
         return(1);
     }
     
+    // the channel list is opened here so --total-budget can count the channels before the first one is sampled;
+    // stdin is copied to a temporary file to be read twice
+    list_fp = NULL;
+    if (list_file != NULL)
+    {
+        if (strcmp(list_file, "-") == 0)
+        {
+            list_fp = stdin;
+            if (sample_total_budget_seconds > 0.0)
+            {
+                list_fp = tmpfile();
+                channel_list_copy = (char *) malloc(65536);
+                if (list_fp == NULL || channel_list_copy == NULL)
+                {
+                    printf("Error copying channel list from stdin\n");
+                    return(1);
+                }
+                while ((n_list_bytes = fread(channel_list_copy, 1, 65536, stdin)) > 0)
+                    fwrite(channel_list_copy, 1, n_list_bytes, list_fp);
+                free(channel_list_copy);
+                rewind(list_fp);
+            }
+        }
+        else
+            list_fp = fopen(list_file, "r");
+        if (list_fp == NULL)
+        {
+            printf("Error opening channel list %s\n", list_file);
+            return(1);
+        }
+    }
+    
+    if (sample_total_budget_seconds > 0.0)
+    {
+        for (i = 1; i < argc; i++)
+        {
+            if (*argv[i] == '-')
+            {
+                if (argv[i][1] == 'p' || argv[i][1] == 'l')
+                    i++;
+                continue;
+            }
+            sample_channels_expected++;
+        }
+        if (list_fp != NULL)
+        {
+            while (fgets(line, sizeof(line), list_fp) != NULL)
+            {
+                line[strcspn(line, "\r\n")] = 0;
+                if (*line != 0 && *line != '#')
+                    sample_channels_expected++;
+            }
+            rewind(list_fp);
+        }
+        printf("Time budget %.0f s for %d channels\n", sample_total_budget_seconds, sample_channels_expected);
+    }
+    sample_run_start = time(NULL);
+    
     // iterate through files and validate.
     i = 1;
     while (i < argc)
@@ -541,18 +1750,65 @@ int main (int argc, const char * argv[]) {
         if (*argv[i] == '-') {
             switch (argv[i][1])
             {
-                // skip password flag and password
+                // skip password flag and password, list flag and list file
                 case 'p':
+                case 'l':
+                    i++;
                     i++;
+                    continue;
+                    break;
+                // long options carry their value after '='
+                case '-':
                     i++;
                     continue;
                     break;
             }
         }
 
-        validate_mef3(argv[i], "test.log", password);
+        if (job_mfp != NULL)
+            n_unreadable += add_job_units(job_mfp, argv[i], password, &next_unit);
+        else
+            validate_mef3(argv[i], "test.log", password);
         i++;
     }
+    
+    // channels listed one per line in a file ("-" for stdin); the list can be any length
+    if (list_fp != NULL)
+    {
+        while (fgets(line, sizeof(line), list_fp) != NULL)
+        {
+            line[strcspn(line, "\r\n")] = 0;
+            if (*line == 0 || *line == '#')
+                continue;
+            if (job_mfp != NULL)
+                n_unreadable += add_job_units(job_mfp, line, password, &next_unit);
+            else
+                validate_mef3(line, "test.log", password);
+        }
+        if (list_fp != stdin)
+            fclose(list_fp);
+    }
+    
+    if (job_mfp != NULL)
+    {
+        fclose(job_mfp);
+        printf("Wrote %ld units to %s\n", next_unit, manifest_name);
+        if (n_unreadable)
+            printf("%d channels could not be read; each is one whole-channel unit, reported as NOT CHECKED until a --job run can read it\n", n_unreadable);
+    }
+    
+    if (sample_fraction > 0.0 && sample_channels_done > 1)
+    {
+        sprintf(line, "All %d channels", sample_channels_done);
+        format_sample_result(message_buffer, line, sample_total_blocks, sample_total_checked, sample_total_bad, sample_total_unreadable);
+        printf("%s", message_buffer);
+    }
+    
+    free(read_buffer); read_buffer = NULL; read_buffer_bytes = 0;
+    
+#ifndef _WIN32
+    report_peak_rss();
+#endif
 
     printf("Done.\n");
     
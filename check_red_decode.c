@@ -0,0 +1,463 @@
+/*
+ *  check_red_decode.c
+ *
+
+ Program to check that RED_decode_fast() produces output bit-identical to meflib's RED_decode().
+
+ Part 1 encodes synthetic signals with meflib's RED_encode() (flat, constant, ramps without 0xFF differences,
+ large keysamples, noise, maximum-size blocks) and decodes each block with RED_decode() and with RED_decode_fast()
+ for every kernel, singly and in batches through RED_decode_fast_blocks(), so the range decoding stage is compared as
+ well as the reconstruction.
+ Part 2 feeds synthetic difference buffers (random lengths, differences, and keysample densities, including
+ wrap-around values) to every reconstruction kernel available on this CPU and compares each against the scalar kernel.
+ Part 3 decodes every block of each channel given on the command line with RED_decode() and with each kernel,
+ in batches through RED_decode_fast_blocks(), and compares the samples.
+
+ Exits with status 1 if any output differs.
+
+ Copyright 2020, Mayo Foundation, Rochester MN. All rights reserved.
+
+ This software is made freely available under the GNU public license: http://www.gnu.org/licenses/gpl-3.0.txt
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "meflib.h"
+#include "red_decode_fast.h"
+#include "mef3_tools.h"
+
+MEF_GLOBALS	*MEF_globals;
+
+#define SYNTHETIC_BUFFERS       20000
+#define SYNTHETIC_MAX_SAMPLES   20000
+#define BATCH_BLOCKS            16
+#define ENCODED_PATTERNS        10
+#define ENCODED_MAX_SAMPLES     262144
+#define ENCODED_SIZES           19
+
+static ui8 rng_state = 0x9E3779B97F4A7C15ULL;
+
+ui4 random_ui4()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return((ui4) ((rng_state * 0x2545F4914F6CDD1DULL) >> 32));
+}
+
+// Synthetic signal number pattern, n_samples long.
+void make_signal(si4 pattern, si4 *samples, ui4 n_samples)
+{
+    ui4 j;
+    si4 value;
+    static const si4 extreme_values[] = {0x7FFFFFFF, (si4) 0x80000000, 0x7FFFFF80, (si4) 0x80000070, 0, -1};
+
+    value = (si4) random_ui4();
+    for (j = 0; j < n_samples; j++) {
+        switch (pattern) {
+            case 0:     // flat zero, e.g. a disconnected electrode
+                samples[j] = 0;
+                break;
+            case 1:     // constant, large value
+                samples[j] = value;
+                break;
+            case 2:     // rising ramp: no 0xFF (-1) differences at all
+                samples[j] = value + (si4) j;
+                break;
+            case 3:     // falling ramp: every difference is 0xFF
+                samples[j] = value - (si4) j;
+                break;
+            case 4:     // small random walk
+                value += (si4) (random_ui4() % 7) - 3;
+                samples[j] = value;
+                break;
+            case 5:     // noise filling the whole one-byte difference range
+                samples[j] = (j == 0) ? 0 : samples[j - 1] + (si4) (random_ui4() % 255) - 127;
+                break;
+            case 6:     // nothing but keysamples, with extreme values
+                samples[j] = (random_ui4() % 2) ? extreme_values[random_ui4() % 6] : (si4) random_ui4();
+                break;
+            case 7:     // sine with noise, like a real recording
+                samples[j] = (si4) (1000.0 * sin(j * 0.05)) + (si4) (random_ui4() % 21) - 10;
+                break;
+            case 8:     // flat with occasional large jumps
+                if (random_ui4() % 100 == 0)
+                    value = (si4) random_ui4();
+                samples[j] = value;
+                break;
+            default:    // alternating zero and +/-1
+                samples[j] = (j & 1) ? ((j & 2) ? 1 : -1) : 0;
+                break;
+        }
+    }
+}
+
+// Encode synthetic signals with RED_encode() and decode each block with RED_decode() and every kernel of
+// RED_decode_fast(), then all blocks of a pattern together through RED_decode_fast_blocks().  Returns the number of
+// mismatches.
+si8 check_encoded_blocks()
+{
+    si4 i, pattern, kernel, n_good;
+    ui4 n_samples[ENCODED_SIZES];
+    si8 n_mismatch, n_blocks;
+    si4 *original, *expected[ENCODED_SIZES], *samples[ENCODED_SIZES];
+    ui1 *compressed[ENCODED_SIZES], *good_blocks[ENCODED_SIZES];
+    si4 *good_expected[ENCODED_SIZES], *good_samples[ENCODED_SIZES];
+    RED_PROCESSING_STRUCT *rps;
+    static const ui4 sizes[ENCODED_SIZES] = {1, 2, 3, 15, 16, 17, 31, 32, 33, 64, 100, 255, 256, 1000, 4096, 0, 0, 0, ENCODED_MAX_SAMPLES};
+
+    n_mismatch = n_blocks = 0;
+    original = (si4 *) calloc(ENCODED_MAX_SAMPLES, sizeof(si4));
+    for (i = 0; i < ENCODED_SIZES; i++) {
+        expected[i] = (si4 *) calloc(ENCODED_MAX_SAMPLES, sizeof(si4));
+        samples[i] = (si4 *) calloc(ENCODED_MAX_SAMPLES, sizeof(si4));
+        compressed[i] = (ui1 *) calloc((size_t) RED_MAX_COMPRESSED_BYTES(ENCODED_MAX_SAMPLES, 1), sizeof(ui1));
+    }
+    rps = (RED_PROCESSING_STRUCT *) calloc((size_t) 1, sizeof(RED_PROCESSING_STRUCT));
+    rps->difference_buffer = (si1 *) e_calloc((size_t) RED_MAX_DIFFERENCE_BYTES(ENCODED_MAX_SAMPLES), sizeof(ui1), __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+
+    for (pattern = 0; pattern < ENCODED_PATTERNS; pattern++) {
+        n_good = 0;
+        for (i = 0; i < ENCODED_SIZES; i++) {
+
+            // zero entries in sizes[] are random lengths
+            n_samples[i] = sizes[i] ? sizes[i] : 1 + random_ui4() % 20000;
+            make_signal(pattern, original, n_samples[i]);
+
+            // encode: no detrending, scaling or encryption (the struct is zeroed), so the block is lossless
+            memset(compressed[i], 0, (size_t) RED_BLOCK_HEADER_BYTES);
+            rps->compression.mode = RED_COMPRESSION;
+            rps->original_data = rps->original_ptr = original;
+            rps->compressed_data = compressed[i];
+            rps->block_header = (RED_BLOCK_HEADER *) compressed[i];
+            rps->block_header->number_of_samples = n_samples[i];
+            rps->block_header->start_time = 0;
+            RED_encode(rps);
+
+            rps->compression.mode = RED_DECOMPRESSION;
+            rps->compressed_data = compressed[i];
+            rps->block_header = (RED_BLOCK_HEADER *) compressed[i];
+            rps->decompressed_ptr = expected[i];
+            RED_decode(rps);
+            n_blocks++;
+
+            if (memcmp(original, expected[i], (size_t) n_samples[i] * sizeof(si4)) != 0) {
+                fprintf(stdout, "Encoded pattern %d (%u samples): RED_decode() does not reproduce the encoded samples\n", pattern, n_samples[i]);
+                n_mismatch++;
+                continue;
+            }
+
+            for (kernel = RED_FAST_KERNEL_SCALAR; kernel <= RED_FAST_KERNEL_AVX2; kernel++) {
+                if (!RED_decode_fast_set_kernel(kernel))
+                    continue;
+                memset(samples[i], 0, (size_t) n_samples[i] * sizeof(si4));
+                rps->decompressed_ptr = samples[i];
+                RED_decode_fast(rps);
+                if (memcmp(expected[i], samples[i], (size_t) n_samples[i] * sizeof(si4)) != 0) {
+                    if (n_mismatch < 10)
+                        fprintf(stdout, "Encoded pattern %d (%u samples): %s output differs from RED_decode()\n",
+                                pattern, n_samples[i], RED_decode_fast_kernel_name(kernel));
+                    n_mismatch++;
+                }
+            }
+
+            good_blocks[n_good] = compressed[i];
+            good_expected[n_good] = expected[i];
+            good_samples[n_good] = samples[i];
+            n_good++;
+        }
+
+        // the same blocks again, range decoded side by side
+        for (kernel = RED_FAST_KERNEL_SCALAR; kernel <= RED_FAST_KERNEL_AVX2; kernel++) {
+            if (!RED_decode_fast_set_kernel(kernel))
+                continue;
+            for (i = 0; i < n_good; i++)
+                memset(good_samples[i], 0, (size_t) ((RED_BLOCK_HEADER *) good_blocks[i])->number_of_samples * sizeof(si4));
+            RED_decode_fast_blocks(rps, good_blocks, good_samples, n_good);
+            for (i = 0; i < n_good; i++) {
+                if (memcmp(good_expected[i], good_samples[i], (size_t) ((RED_BLOCK_HEADER *) good_blocks[i])->number_of_samples * sizeof(si4)) != 0) {
+                    if (n_mismatch < 10)
+                        fprintf(stdout, "Encoded pattern %d (%u samples): %s batch output differs from RED_decode()\n",
+                                pattern, ((RED_BLOCK_HEADER *) good_blocks[i])->number_of_samples, RED_decode_fast_kernel_name(kernel));
+                    n_mismatch++;
+                }
+            }
+        }
+    }
+
+    fprintf(stdout, "Encoded: %ld blocks decoded with RED_decode() and every kernel, singly and in batches, %ld mismatches\n", n_blocks, n_mismatch);
+
+    free(original);
+    for (i = 0; i < ENCODED_SIZES; i++) {
+        free(expected[i]);
+        free(samples[i]);
+        free(compressed[i]);
+    }
+    free(rps->difference_buffer);
+    free(rps);
+
+    return(n_mismatch);
+}
+
+// Random difference buffers.  Buffers are allocated to their exact length so out-of-bounds reads by a kernel can be
+// caught with a memory checker.  Returns the number of mismatches.
+si8 check_synthetic()
+{
+    si4 i, kernel, keysample_permille;
+    ui4 j, n_samples, n_bytes;
+    si4 value;
+    si8 n_mismatch, n_compared;
+    si1 *differences;
+    si4 *expected, *samples;
+    static const si4 keysample_rates[] = {0, 1, 20, 250, 1000};
+    static const si4 extreme_values[] = {0, 1, -1, 0x7FFFFFFF, (si4) 0x80000000, 0x7FFFFF80, (si4) 0x80000070};
+
+    n_mismatch = n_compared = 0;
+    expected = (si4 *) calloc(SYNTHETIC_MAX_SAMPLES + 1, sizeof(si4));
+    samples = (si4 *) calloc(SYNTHETIC_MAX_SAMPLES + 1, sizeof(si4));
+
+    for (i = 0; i < SYNTHETIC_BUFFERS; i++) {
+
+        // every length up to 100 (covers all tail sizes of the vector loops), then random lengths
+        n_samples = (i < 1000) ? (ui4) (i % 101) : random_ui4() % SYNTHETIC_MAX_SAMPLES;
+        keysample_permille = keysample_rates[(i / 101) % 5];
+
+        differences = (si1 *) malloc((size_t) n_samples * 5 + 1);
+        n_bytes = 0;
+        for (j = 0; j < n_samples; j++) {
+            // RED blocks start with a keysample
+            if (j == 0 || (si4) (random_ui4() % 1000) < keysample_permille) {
+                if (random_ui4() % 4 == 0)
+                    value = extreme_values[random_ui4() % 7];
+                else
+                    value = (si4) random_ui4();
+                differences[n_bytes++] = RED_KEYSAMPLE_FLAG;
+                memcpy(differences + n_bytes, &value, sizeof(si4));
+                n_bytes += 4;
+            }
+            else
+                differences[n_bytes++] = (si1) ((si4) (random_ui4() % 255) - 127);
+        }
+        // shrink to the exact size
+        differences = (si1 *) realloc(differences, (size_t) n_bytes + 1);
+
+        RED_reconstruct_scalar(differences, expected, n_samples);
+
+        for (kernel = RED_FAST_KERNEL_SSE41; kernel <= RED_FAST_KERNEL_AVX2; kernel++) {
+            if (!RED_decode_fast_set_kernel(kernel))
+                continue;
+            memset(samples, 0, (size_t) n_samples * sizeof(si4));
+            RED_reconstruct(kernel, differences, samples, n_samples);
+            n_compared++;
+            if (memcmp(expected, samples, (size_t) n_samples * sizeof(si4)) != 0) {
+                if (n_mismatch < 10)
+                    fprintf(stdout, "Synthetic buffer %d (%u samples, keysample rate %d/1000): %s output differs from scalar\n",
+                            i, n_samples, keysample_permille, RED_decode_fast_kernel_name(kernel));
+                n_mismatch++;
+            }
+        }
+
+        free(differences);
+    }
+
+    fprintf(stdout, "Synthetic: %ld kernel comparisons, %ld mismatches\n", n_compared, n_mismatch);
+
+    free(expected);
+    free(samples);
+
+    return(n_mismatch);
+}
+
+// Decode every block of a channel, BATCH_BLOCKS at a time, with RED_decode() and with each kernel.
+// Returns the number of mismatching blocks, or -1 if the channel could not be read.
+si8 check_channel(si1 *channel_name, si1 *password, si8 max_blocks)
+{
+    si4 i, b, kernel, numSegments, start_segment, numBlocks, start_block, n_batch;
+    ui4 max_samps;
+    ui8 inDataLength;
+    si8 n_blocks, n_mismatch;
+    ui1 *blocks[BATCH_BLOCKS];
+    si4 *expected[BATCH_BLOCKS], *samples[BATCH_BLOCKS];
+    CHANNEL *channel;
+    TIME_SERIES_INDEX *tsi;
+    RED_PROCESSING_STRUCT *rps;
+    FILE *fp;
+
+    channel = read_MEF_channel(NULL, channel_name, TIME_SERIES_CHANNEL_TYPE, password, NULL, MEF_FALSE, MEF_FALSE);
+    if (channel == NULL) {
+        fprintf(stdout, "[%s] Error with read_MEF_channel() for %s, returned NULL\n", __FUNCTION__, channel_name);
+        return(-1);
+    }
+
+    inDataLength = channel->metadata.time_series_section_2->maximum_block_bytes;
+    max_samps = channel->metadata.time_series_section_2->maximum_block_samples;
+    for (i = 0; i < BATCH_BLOCKS; i++) {
+        blocks[i] = (ui1 *) malloc(inDataLength);
+        expected[i] = (si4 *) calloc(max_samps, sizeof(si4));
+        samples[i] = (si4 *) calloc(max_samps, sizeof(si4));
+    }
+
+    // create RED processing struct
+    rps = (RED_PROCESSING_STRUCT *) calloc((size_t) 1, sizeof(RED_PROCESSING_STRUCT));
+    rps->compression.mode = RED_DECOMPRESSION;
+    rps->password_data = channel->segments[0].metadata_fps->password_data;
+    rps->difference_buffer = (si1 *) e_calloc((size_t) RED_MAX_DIFFERENCE_BYTES(max_samps), sizeof(ui1), __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+
+    n_blocks = n_mismatch = 0;
+    numSegments = channel->number_of_segments;
+
+    for (start_segment = 0; start_segment < numSegments && n_blocks < max_blocks; start_segment++) {
+
+        fp = fopen(channel->segments[start_segment].time_series_data_fps->full_file_name, "rb");
+        if (fp == NULL) {
+            fprintf(stdout, "[%s] Error opening %s\n", __FUNCTION__, channel->segments[start_segment].time_series_data_fps->full_file_name);
+            continue;
+        }
+
+        numBlocks = channel->segments[start_segment].time_series_indices_fps->universal_header->number_of_entries;
+        start_block = 0;
+
+        while (start_block < numBlocks && n_blocks < max_blocks) {
+
+            // read a batch of CRC-valid blocks
+            n_batch = 0;
+            while (n_batch < BATCH_BLOCKS && start_block < numBlocks && n_blocks + n_batch < max_blocks) {
+                tsi = &channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_block++];
+                if (tsi->block_bytes > inDataLength)
+                    continue;
+#ifndef _WIN32
+                fseek(fp, tsi->file_offset, SEEK_SET);
+#else
+                _fseeki64(fp, tsi->file_offset, SEEK_SET);
+#endif
+                if (fread(blocks[n_batch], sizeof(si1), (size_t) tsi->block_bytes, fp) != tsi->block_bytes)
+                    continue;
+                if (!check_block_crc(blocks[n_batch], max_samps, blocks[n_batch], inDataLength))
+                    continue;
+                n_batch++;
+            }
+
+            for (b = 0; b < n_batch; b++) {
+                rps->compressed_data = blocks[b];
+                rps->block_header = (RED_BLOCK_HEADER *) blocks[b];
+                rps->decompressed_ptr = expected[b];
+                RED_decode(rps);
+            }
+
+            for (kernel = RED_FAST_KERNEL_SCALAR; kernel <= RED_FAST_KERNEL_AVX2; kernel++) {
+                if (!RED_decode_fast_set_kernel(kernel))
+                    continue;
+                for (b = 0; b < n_batch; b++)
+                    memset(samples[b], 0, max_samps * sizeof(si4));
+                RED_decode_fast_blocks(rps, blocks, samples, n_batch);
+                for (b = 0; b < n_batch; b++) {
+                    if (memcmp(expected[b], samples[b], ((RED_BLOCK_HEADER *) blocks[b])->number_of_samples * sizeof(si4)) != 0) {
+                        if (n_mismatch < 10)
+                            fprintf(stdout, "%s segment %d: %s output differs from RED_decode() in a block starting at time %ld\n",
+                                    channel_name, start_segment, RED_decode_fast_kernel_name(kernel), ((RED_BLOCK_HEADER *) blocks[b])->start_time);
+                        n_mismatch++;
+                    }
+                }
+            }
+
+            n_blocks += n_batch;
+        }
+
+        fclose(fp);
+    }
+
+    fprintf(stdout, "%s: %ld blocks decoded with every kernel, %ld mismatches\n", channel_name, n_blocks, n_mismatch);
+
+    // clean up
+    for (i = 0; i < BATCH_BLOCKS; i++) {
+        free(blocks[i]);
+        free(expected[i]);
+        free(samples[i]);
+    }
+    free(rps->difference_buffer);
+    free(rps);
+    free_channel(channel, MEF_TRUE);
+
+    return(n_mismatch);
+}
+
+int main (int argc, const char * argv[]) {
+    si4 i, kernel, failed;
+    si1 *password;
+    si8 max_blocks, result;
+
+    (void) initialize_meflib();
+
+    password = NULL;
+    max_blocks = 0x7FFFFFFFFFFFFFFFLL;
+    failed = 0;
+
+    // the comparison is done here, so the decoder's own self-check is not wanted
+    RED_decode_fast_set_verify(0, 0);
+
+    fprintf(stdout, "Kernels available:");
+    for (kernel = RED_FAST_KERNEL_SCALAR; kernel <= RED_FAST_KERNEL_AVX2; kernel++)
+        if (RED_decode_fast_set_kernel(kernel))
+            fprintf(stdout, " %s", RED_decode_fast_kernel_name(kernel));
+    fprintf(stdout, "\n");
+
+    if (check_encoded_blocks())
+        failed = 1;
+    if (check_synthetic())
+        failed = 1;
+
+    i = 1;
+    while (i < argc)
+    {
+        if (*argv[i] == '-') {
+            if (i + 1 >= argc)
+            {
+                (void) printf("USAGE: %s [chan_folder[s]] [-p password] [-n max_blocks_per_channel]\n", argv[0]);
+                return(1);
+            }
+            switch (argv[i][1])
+            {
+                case 'p':
+                    password = (si1 *) argv[i+1];
+                    break;
+                case 'n':
+                    max_blocks = atol(argv[i+1]);
+                    break;
+            }
+            i += 2;
+            continue;
+        }
+        i++;
+    }
+
+    i = 1;
+    while (i < argc)
+    {
+        if (*argv[i] == '-') {
+            i += 2;
+            continue;
+        }
+        result = check_channel((si1 *) argv[i], password, max_blocks);
+        if (result != 0)
+            failed = 1;
+        i++;
+    }
+
+    printf(failed ? "FAILED: decoders disagree or a channel could not be read.\n" : "All decoders agree.\n");
+
+    return (failed);
+}
@@ -0,0 +1,408 @@
+/*
+ *  export_mef3.c
+ *
+
+ Program to export decoded MEF 3 channels to a chunked binary format that can be memory-mapped directly.
+
+ Each channel is written as <output_dir>/<channel_name>.chunks, a sequence of fixed-size chunks, and a chunk
+ index <output_dir>/<channel_name>.cidx.  Every chunk is a 64-byte CHUNK_HEADER followed by chunk_samples
+ little-endian si4 samples, so chunk k always starts at k * (CHUNK_HEADER_BYTES + 4 * chunk_samples).  A chunk
+ never spans a discontinuity; a chunk that ends early is zero-padded and its header gives the real sample count.
+
+ From Python, for example:
+     np.memmap("chan.chunks", dtype="<i4", mode="r", offset=k * chunk_bytes + 64, shape=(number_of_samples,))
+
+ Channels are exported concurrently, one channel per worker thread.
+
+ Copyright 2020, Mayo Foundation, Rochester MN. All rights reserved.
+
+ This software is made freely available under the GNU public license: http://www.gnu.org/licenses/gpl-3.0.txt
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "meflib.h"
+#include "red_decode_fast.h"
+#include "mef3_tools.h"
+
+MEF_GLOBALS	*MEF_globals;
+
+#define CHUNK_MAGIC             "MEFCHNK1"
+#define CHUNK_INDEX_MAGIC       "MEFCIDX1"
+#define CHUNK_HEADER_BYTES      64
+#define DEFAULT_CHUNK_SAMPLES   1048576
+// each worker holds one chunk in memory: 64 MiB at this limit
+#define MAX_CHUNK_SAMPLES       16777216
+#define DEFAULT_THREADS         4
+
+// chunk flags
+#define CHUNK_DISCONTINUITY     1   // first sample of this chunk does not follow the last sample of the previous chunk
+#define CHUNK_BAD_BLOCKS        2   // one or more blocks were dropped (CRC or read failure) immediately before this chunk
+
+typedef struct {
+    si1     magic[8];
+    si8     start_time;             // uUTC of first sample, recording time offset removed
+    si8     start_sample;           // channel sample number of first sample
+    ui4     number_of_samples;      // valid samples in this chunk, <= chunk_samples
+    ui4     chunk_samples;
+    sf8     sampling_frequency;
+    ui4     flags;
+    ui1     pad[CHUNK_HEADER_BYTES - 44];
+} CHUNK_HEADER;
+
+typedef struct {
+    si1     magic[8];
+    si8     number_of_chunks;
+    si8     chunk_bytes;            // header + samples, i.e. stride between chunks in the .chunks file
+    ui4     chunk_samples;
+    ui4     pad;
+    sf8     sampling_frequency;
+    sf8     units_conversion_factor;
+} CHUNK_INDEX_HEADER;
+
+typedef struct {
+    si8     file_offset;
+    si8     start_time;
+    si8     start_sample;
+    ui4     number_of_samples;
+    ui4     flags;
+} CHUNK_INDEX_ENTRY;
+
+typedef struct {
+    si1     *channel_name;
+    si1     *password;
+    si1     *output_dir;
+    ui4     chunk_samples;
+} EXPORT_JOB;
+
+
+// write the pending chunk (zero-padded to full size) and its index entry, then reset the chunk
+int flush_chunk(FILE *cfp, FILE *ifp, CHUNK_HEADER *chunk_header, si4 *chunk_data, si8 *number_of_chunks)
+{
+    CHUNK_INDEX_ENTRY entry;
+    si4 write_failed = 0;
+
+    if (chunk_header->number_of_samples == 0)
+        return(0);
+
+    if (chunk_header->number_of_samples < chunk_header->chunk_samples)
+        memset(chunk_data + chunk_header->number_of_samples, 0, (chunk_header->chunk_samples - chunk_header->number_of_samples) * sizeof(si4));
+
+    entry.file_offset = *number_of_chunks * (si8) (CHUNK_HEADER_BYTES + chunk_header->chunk_samples * sizeof(si4));
+    entry.start_time = chunk_header->start_time;
+    entry.start_sample = chunk_header->start_sample;
+    entry.number_of_samples = chunk_header->number_of_samples;
+    entry.flags = chunk_header->flags;
+
+    if (fwrite(chunk_header, CHUNK_HEADER_BYTES, 1, cfp) != 1 ||
+        fwrite(chunk_data, sizeof(si4), chunk_header->chunk_samples, cfp) != chunk_header->chunk_samples ||
+        fwrite(&entry, sizeof(entry), 1, ifp) != 1)
+        write_failed = 1;
+    else
+        (*number_of_chunks)++;
+
+    // reset even on failure, so the caller never overruns chunk_data
+    chunk_header->number_of_samples = 0;
+    chunk_header->flags = 0;
+
+    return(write_failed);
+}
+
+si4 export_channel(void *arg)
+{
+    si4 i, numSegments, start_segment, numBlocks, start_block, write_error;
+    si4 *data, *chunk_data;
+    ui1 *in_data;
+    ui4 max_samps, pending_flags;
+    ui8 inDataLength;
+    si8 expected_time, expected_sample, temp_time, number_of_chunks, n_bad_blocks;
+    si8 segment_start_sample, block_start_sample;
+    sf8 fs;
+    si1 chunk_name[1024], index_name[1024];
+    CHANNEL *channel;
+    TIME_SERIES_INDEX *tsi;
+    RED_PROCESSING_STRUCT *rps;
+    CHUNK_HEADER chunk_header;
+    CHUNK_INDEX_HEADER index_header;
+    FILE *fp, *cfp, *ifp;
+    EXPORT_JOB *job;
+
+    job = (EXPORT_JOB *) arg;
+
+    channel = read_MEF_channel_serialized(job->channel_name, job->password);
+
+    if (channel == NULL) {
+        fprintf(stdout, "[%s] Error with read_MEF_channel() for %s, returned NULL\n", __FUNCTION__, job->channel_name);
+        return(1);
+    }
+
+    fs = channel->metadata.time_series_section_2->sampling_frequency;
+
+    // all per-channel buffers are allocated before any output file is created
+    inDataLength = channel->metadata.time_series_section_2->maximum_block_bytes;
+    max_samps = channel->metadata.time_series_section_2->maximum_block_samples;
+    in_data = malloc(inDataLength);
+    data = calloc(max_samps, sizeof(si4));
+    chunk_data = calloc(job->chunk_samples, sizeof(si4));
+    rps = (RED_PROCESSING_STRUCT *) calloc((size_t) 1, sizeof(RED_PROCESSING_STRUCT));
+    if (in_data == NULL || data == NULL || chunk_data == NULL || rps == NULL) {
+        fprintf(stdout, "[%s] Error allocating buffers for %s\n", __FUNCTION__, job->channel_name);
+        free(in_data); free(data); free(chunk_data); free(rps);
+        free_channel(channel, MEF_TRUE);
+        return(1);
+    }
+    rps->compression.mode = RED_DECOMPRESSION;
+    rps->password_data = channel->segments[0].metadata_fps->password_data;
+    rps->difference_buffer = (si1 *) e_calloc((size_t) RED_MAX_DIFFERENCE_BYTES(max_samps), sizeof(ui1), __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    if (rps->difference_buffer == NULL) {
+        fprintf(stdout, "[%s] Error allocating buffers for %s\n", __FUNCTION__, job->channel_name);
+        free(in_data); free(data); free(chunk_data); free(rps);
+        free_channel(channel, MEF_TRUE);
+        return(1);
+    }
+
+    sprintf(chunk_name, "%s/%s.chunks", job->output_dir, channel->name);
+    sprintf(index_name, "%s/%s.cidx", job->output_dir, channel->name);
+    cfp = fopen(chunk_name, "wb");
+    ifp = fopen(index_name, "wb");
+    if (cfp == NULL || ifp == NULL) {
+        fprintf(stdout, "[%s] Error opening %s or %s for writing\n", __FUNCTION__, chunk_name, index_name);
+        if (cfp != NULL) fclose(cfp);
+        if (ifp != NULL) fclose(ifp);
+        free(in_data); free(data); free(chunk_data); free(rps->difference_buffer); free(rps);
+        free_channel(channel, MEF_TRUE);
+        return(1);
+    }
+
+    // index header is rewritten with the final chunk count once the export is complete
+    memset(&index_header, 0, sizeof(index_header));
+    memcpy(index_header.magic, CHUNK_INDEX_MAGIC, 8);
+    index_header.chunk_samples = job->chunk_samples;
+    index_header.chunk_bytes = CHUNK_HEADER_BYTES + (si8) job->chunk_samples * sizeof(si4);
+    index_header.sampling_frequency = fs;
+    index_header.units_conversion_factor = channel->metadata.time_series_section_2->units_conversion_factor;
+    fwrite(&index_header, sizeof(index_header), 1, ifp);
+
+    memset(&chunk_header, 0, sizeof(chunk_header));
+    memcpy(chunk_header.magic, CHUNK_MAGIC, 8);
+    chunk_header.chunk_samples = job->chunk_samples;
+    chunk_header.sampling_frequency = fs;
+
+    number_of_chunks = n_bad_blocks = 0;
+    expected_time = expected_sample = -1;
+    pending_flags = 0;
+    write_error = 0;
+
+    numSegments = channel->number_of_segments;
+
+    // iterate over segments
+    for (start_segment = 0; start_segment < numSegments && !write_error; start_segment++) {
+
+        if (channel->segments[start_segment].time_series_data_fps->fp == NULL) {
+            channel->segments[start_segment].time_series_data_fps->fp = fopen(channel->segments[start_segment].time_series_data_fps->full_file_name, "rb");
+            if (channel->segments[start_segment].time_series_data_fps->fp == NULL) {
+                fprintf(stdout, "[%s] Error opening %s\n", __FUNCTION__, channel->segments[start_segment].time_series_data_fps->full_file_name);
+                pending_flags |= CHUNK_BAD_BLOCKS;
+                continue;
+            }
+#ifndef _WIN32
+            channel->segments[start_segment].time_series_data_fps->fd = fileno(channel->segments[start_segment].time_series_data_fps->fp);
+#else
+            channel->segments[start_segment].time_series_data_fps->fd = _fileno(channel->segments[start_segment].time_series_data_fps->fp);
+#endif
+        }
+        fp = channel->segments[start_segment].time_series_data_fps->fp;
+
+        numBlocks = channel->segments[start_segment].time_series_indices_fps->universal_header->number_of_entries;
+        // index start_sample values are relative to the segment
+        segment_start_sample = channel->segments[start_segment].metadata_fps->metadata.time_series_section_2->start_sample;
+
+        // iterate over blocks within a segment
+        for (start_block = 0; start_block < numBlocks && !write_error; start_block++) {
+
+            tsi = &channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_block];
+
+            if (tsi->block_bytes > inDataLength) {
+                n_bad_blocks++;
+                pending_flags |= CHUNK_BAD_BLOCKS;
+                continue;
+            }
+#ifndef _WIN32
+            fseek(fp, tsi->file_offset, SEEK_SET);
+#else
+            _fseeki64(fp, tsi->file_offset, SEEK_SET);
+#endif
+            if (fread(in_data, sizeof(si1), (size_t) tsi->block_bytes, fp) != tsi->block_bytes) {
+                n_bad_blocks++;
+                pending_flags |= CHUNK_BAD_BLOCKS;
+                continue;
+            }
+
+            rps->compressed_data = in_data;
+            rps->decompressed_ptr = data;
+            rps->block_header = (RED_BLOCK_HEADER *) rps->compressed_data;
+            if (!check_block_crc((ui1*)(rps->block_header), max_samps, in_data, inDataLength)) {
+                n_bad_blocks++;
+                pending_flags |= CHUNK_BAD_BLOCKS;
+                continue;
+            }
+
+            RED_decode_fast(rps);
+
+            temp_time = rps->block_header->start_time;
+            remove_recording_time_offset(&temp_time);
+            block_start_sample = segment_start_sample + tsi->start_sample;
+
+            // a block that does not continue the previous one in time or sample number closes the current chunk
+            if ((rps->block_header->flags & RED_DISCONTINUITY_MASK) || pending_flags ||
+                block_start_sample != expected_sample || llabs(temp_time - expected_time) > (si8) (1e6 / fs)) {
+                if (flush_chunk(cfp, ifp, &chunk_header, chunk_data, &number_of_chunks))
+                    write_error = 1;
+                chunk_header.flags = pending_flags | CHUNK_DISCONTINUITY;
+                pending_flags = 0;
+            }
+
+            for (i = 0; i < rps->block_header->number_of_samples; i++) {
+                if (chunk_header.number_of_samples == 0) {
+                    chunk_header.start_time = temp_time + (si8) (0.5 + (1e6 * i) / fs);
+                    chunk_header.start_sample = block_start_sample + i;
+                }
+                chunk_data[chunk_header.number_of_samples++] = data[i];
+                if (chunk_header.number_of_samples == job->chunk_samples) {
+                    if (flush_chunk(cfp, ifp, &chunk_header, chunk_data, &number_of_chunks))
+                        write_error = 1;
+                }
+            }
+
+            expected_sample = block_start_sample + rps->block_header->number_of_samples;
+            expected_time = temp_time + (si8) (0.5 + (1e6 * rps->block_header->number_of_samples) / fs);
+        }
+
+        if (channel->segments[start_segment].time_series_data_fps->fp != NULL) {
+            fclose(channel->segments[start_segment].time_series_data_fps->fp);
+            channel->segments[start_segment].time_series_data_fps->fp = NULL;
+        }
+    }
+
+    if (flush_chunk(cfp, ifp, &chunk_header, chunk_data, &number_of_chunks))
+        write_error = 1;
+
+    index_header.number_of_chunks = number_of_chunks;
+    fseek(ifp, 0, SEEK_SET);
+    if (fwrite(&index_header, sizeof(index_header), 1, ifp) != 1)
+        write_error = 1;
+
+    if (fclose(cfp) || write_error)
+        write_error = 1;
+    if (fclose(ifp))
+        write_error = 1;
+
+    if (write_error)
+        fprintf(stdout, "[%s] Error writing %s\n", __FUNCTION__, chunk_name);
+    else
+#ifndef _WIN32
+        fprintf(stdout, "%s: %ld chunks written to %s, %ld unreadable blocks\n", job->channel_name, number_of_chunks, chunk_name, n_bad_blocks);
+#else
+        fprintf(stdout, "%s: %lld chunks written to %s, %lld unreadable blocks\n", job->channel_name, number_of_chunks, chunk_name, n_bad_blocks);
+#endif
+
+    // clean up
+    free(in_data);
+    free(data);
+    free(chunk_data);
+    free(rps->difference_buffer);
+    free(rps);
+    free_channel(channel, MEF_TRUE);
+
+    return(write_error);
+}
+
+int main (int argc, const char * argv[]) {
+    si4 i, n_threads, n_failed, number_of_jobs;
+    si1 *password, *output_dir;
+    si8 chunk_samples;
+    EXPORT_JOB *jobs;
+
+    (void) initialize_meflib();
+    // pick the RED decode kernel before the workers start
+    RED_decode_fast_init();
+
+    password = NULL;
+    output_dir = ".";
+    chunk_samples = DEFAULT_CHUNK_SAMPLES;
+    n_threads = DEFAULT_THREADS;
+
+    if (argc < 2)
+    {
+        (void) printf("USAGE: %s chan_folder[s] [-p password] [-c chunk_samples] [-t threads] [-o output_dir]\n", argv[0]);
+        return(1);
+    }
+
+    jobs = (EXPORT_JOB *) calloc((size_t) argc, sizeof(EXPORT_JOB));
+    number_of_jobs = 0;
+
+    // parse options; everything that is not an option or option argument is a channel
+    i = 1;
+    while (i < argc)
+    {
+        if (*argv[i] == '-') {
+            if (i + 1 >= argc)
+            {
+                (void) printf("USAGE: %s chan_folder[s] [-p password] [-c chunk_samples] [-t threads] [-o output_dir]\n", argv[0]);
+                return(1);
+            }
+            switch (argv[i][1])
+            {
+                case 'p':
+                    password = (si1 *) argv[i+1];
+                    break;
+                case 'c':
+                    chunk_samples = atol(argv[i+1]);
+                    break;
+                case 't':
+                    n_threads = atoi(argv[i+1]);
+                    break;
+                case 'o':
+                    output_dir = (si1 *) argv[i+1];
+                    break;
+            }
+            i += 2;
+            continue;
+        }
+        jobs[number_of_jobs++].channel_name = (si1 *) argv[i];
+        i++;
+    }
+
+    if (chunk_samples < 1 || chunk_samples > MAX_CHUNK_SAMPLES)
+    {
+        printf("Chunk size must be between 1 and %d samples.\n", MAX_CHUNK_SAMPLES);
+        return(1);
+    }
+
+    for (i = 0; i < number_of_jobs; i++) {
+        jobs[i].password = password;
+        jobs[i].output_dir = output_dir;
+        jobs[i].chunk_samples = (ui4) chunk_samples;
+    }
+
+    n_failed = run_jobs(jobs, sizeof(EXPORT_JOB), number_of_jobs, n_threads, export_channel);
+
+    printf("Done, %d of %d channels exported.\n", number_of_jobs - n_failed, number_of_jobs);
+
+    free(jobs);
+
+    return (n_failed ? 1 : 0);
+}
@@ -0,0 +1,503 @@
+/*
+ *  mef3_features.c
+ *
+
+ Program to compute windowed spectral band powers and line length for one or more MEF 3 channels.
+
+ Channels are decoded in parallel, one channel per worker thread.  Each channel is streamed block by block
+ through a fixed-size sliding window, so memory use does not depend on the length of the recording.  Each
+ completed window produces one fixed-size record in <output_dir>/<channel_name>.features.
+
+ Copyright 2020, Mayo Foundation, Rochester MN. All rights reserved.
+
+ This software is made freely available under the GNU public license: http://www.gnu.org/licenses/gpl-3.0.txt
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "meflib.h"
+#include "red_decode_fast.h"
+#include "mef3_tools.h"
+
+MEF_GLOBALS	*MEF_globals;
+
+#define NUMBER_OF_BANDS         6
+#define FEATURES_MAGIC          "MEFFEAT1"
+#define DEFAULT_WINDOW_SECONDS  2.0
+#define DEFAULT_STEP_SECONDS    1.0
+#define DEFAULT_THREADS         4
+
+// band edges in Hz: delta, theta, alpha, beta, gamma, high gamma
+static const sf4 band_edges[NUMBER_OF_BANDS][2] = {
+    {0.5, 4.0}, {4.0, 8.0}, {8.0, 13.0}, {13.0, 30.0}, {30.0, 80.0}, {80.0, 200.0}
+};
+
+// On-disk layout of a .features file: one FEATURE_FILE_HEADER followed by one FEATURE_RECORD per window.
+// Band powers are in (converted units)^2, line length is in converted units per window.
+typedef struct {
+    si1     magic[8];
+    sf8     sampling_frequency;
+    si4     window_samples;
+    si4     step_samples;
+    si4     fft_points;
+    si4     number_of_bands;
+    sf4     band_edges[NUMBER_OF_BANDS][2];
+} FEATURE_FILE_HEADER;
+
+typedef struct {
+    si8     start_time;
+    si8     start_sample;
+    sf4     band_power[NUMBER_OF_BANDS];
+    sf4     line_length;
+    ui4     flags;      // bit 0 set if a block was dropped (unreadable or failed its CRC check) since the previous record
+} FEATURE_RECORD;
+
+// Precomputed radix-2 FFT tables.  Built once per channel, reused for every window.
+typedef struct {
+    si4     n;
+    ui4     *bit_reverse;
+    sf8     *cos_table;
+    sf8     *sin_table;
+} FFT_PLAN;
+
+typedef struct {
+    si1     *channel_name;
+    si1     *password;
+    si1     *output_dir;
+    sf8     window_seconds;
+    sf8     step_seconds;
+} FEATURE_JOB;
+
+
+int create_fft_plan(FFT_PLAN *plan, si4 n)
+{
+    si4 i, j, bits;
+
+    plan->n = n;
+    for (bits = 0; (1 << bits) < n; bits++);
+
+    plan->bit_reverse = (ui4 *) calloc((size_t) n, sizeof(ui4));
+    plan->cos_table = (sf8 *) calloc((size_t) n / 2, sizeof(sf8));
+    plan->sin_table = (sf8 *) calloc((size_t) n / 2, sizeof(sf8));
+    if (plan->bit_reverse == NULL || plan->cos_table == NULL || plan->sin_table == NULL)
+        return(1);
+
+    for (i = 0; i < n; i++) {
+        plan->bit_reverse[i] = 0;
+        for (j = 0; j < bits; j++)
+            if (i & (1 << j))
+                plan->bit_reverse[i] |= 1 << (bits - 1 - j);
+    }
+
+    for (i = 0; i < n / 2; i++) {
+        plan->cos_table[i] = cos(2.0 * M_PI * i / n);
+        plan->sin_table[i] = -sin(2.0 * M_PI * i / n);
+    }
+
+    return(0);
+}
+
+void free_fft_plan(FFT_PLAN *plan)
+{
+    free(plan->bit_reverse); plan->bit_reverse = NULL;
+    free(plan->cos_table); plan->cos_table = NULL;
+    free(plan->sin_table); plan->sin_table = NULL;
+}
+
+// in-place forward FFT of (re, im), both of length plan->n
+void execute_fft(FFT_PLAN *plan, sf8 *re, sf8 *im)
+{
+    si4 i, j, k, n, half, stride;
+    sf8 tr, ti, wr, wi;
+
+    n = plan->n;
+
+    for (i = 0; i < n; i++) {
+        j = plan->bit_reverse[i];
+        if (j > i) {
+            tr = re[i]; re[i] = re[j]; re[j] = tr;
+            ti = im[i]; im[i] = im[j]; im[j] = ti;
+        }
+    }
+
+    for (half = 1; half < n; half <<= 1) {
+        stride = n / (half << 1);
+        for (i = 0; i < n; i += half << 1) {
+            for (k = 0; k < half; k++) {
+                wr = plan->cos_table[k * stride];
+                wi = plan->sin_table[k * stride];
+                j = i + k + half;
+                tr = wr * re[j] - wi * im[j];
+                ti = wr * im[j] + wi * re[j];
+                re[j] = re[i + k] - tr;
+                im[j] = im[i + k] - ti;
+                re[i + k] += tr;
+                im[i + k] += ti;
+            }
+        }
+    }
+}
+
+si4 extract_channel_features(void *arg)
+{
+    si4 i, j, k, b, numSegments, start_segment, numBlocks, start_block;
+    si4 window_samples, step_samples, fft_points;
+    si4 ring_pos, ring_filled, since_last_window, write_error;
+    si4 band_lo[NUMBER_OF_BANDS], band_hi[NUMBER_OF_BANDS];
+    si4 *data;
+    ui1 *in_data;
+    ui4 max_samps, window_flags, block_flags;
+    ui8 inDataLength;
+    si8 run_start_time, run_start_sample, run_samples, expected_time, temp_time, segment_start_sample;
+    si8 n_windows, n_crc_errors;
+    sf8 fs, ucf, mean, power_scale, window_power, line_length, power;
+    sf8 *ring, *hann, *re, *im;
+    si1 output_name[1024];
+    CHANNEL *channel;
+    TIME_SERIES_INDEX *tsi;
+    RED_PROCESSING_STRUCT *rps;
+    FFT_PLAN plan;
+    FEATURE_FILE_HEADER header;
+    FEATURE_RECORD record;
+    FILE *fp, *ofp;
+    FEATURE_JOB *job;
+
+    job = (FEATURE_JOB *) arg;
+
+    channel = read_MEF_channel_serialized(job->channel_name, job->password);
+
+    if (channel == NULL) {
+        fprintf(stdout, "[%s] Error with read_MEF_channel() for %s, returned NULL\n", __FUNCTION__, job->channel_name);
+        return(1);
+    }
+
+    fs = channel->metadata.time_series_section_2->sampling_frequency;
+    ucf = channel->metadata.time_series_section_2->units_conversion_factor;
+    if (ucf == 0.0)
+        ucf = 1.0;
+    window_samples = (si4) (job->window_seconds * fs + 0.5);
+    step_samples = (si4) (job->step_seconds * fs + 0.5);
+    if (window_samples < 2 || step_samples < 1) {
+        fprintf(stdout, "[%s] Window or step too short for sampling frequency %f in %s\n", __FUNCTION__, fs, job->channel_name);
+        free_channel(channel, MEF_TRUE);
+        return(1);
+    }
+    for (fft_points = 1; fft_points < window_samples; fft_points <<= 1);
+
+    // map band edges to FFT bins, clipping bands that lie above Nyquist
+    for (b = 0; b < NUMBER_OF_BANDS; b++) {
+        band_lo[b] = (si4) ceil(band_edges[b][0] * fft_points / fs);
+        band_hi[b] = (si4) ceil(band_edges[b][1] * fft_points / fs);
+        if (band_lo[b] > fft_points / 2) band_lo[b] = fft_points / 2;
+        if (band_hi[b] > fft_points / 2) band_hi[b] = fft_points / 2;
+    }
+
+    // all per-channel buffers are allocated here; the window loop below never allocates
+    inDataLength = channel->metadata.time_series_section_2->maximum_block_bytes;
+    max_samps = channel->metadata.time_series_section_2->maximum_block_samples;
+    in_data = malloc(inDataLength);
+    data = calloc(max_samps, sizeof(si4));
+    ring = calloc(window_samples, sizeof(sf8));
+    hann = calloc(window_samples, sizeof(sf8));
+    re = calloc(fft_points, sizeof(sf8));
+    im = calloc(fft_points, sizeof(sf8));
+    rps = (RED_PROCESSING_STRUCT *) calloc((size_t) 1, sizeof(RED_PROCESSING_STRUCT));
+    memset(&plan, 0, sizeof(plan));
+    if (in_data == NULL || data == NULL || ring == NULL || hann == NULL || re == NULL || im == NULL || rps == NULL ||
+        create_fft_plan(&plan, fft_points)) {
+        fprintf(stdout, "[%s] Error allocating buffers for %s\n", __FUNCTION__, job->channel_name);
+        free(in_data); free(data); free(ring); free(hann); free(re); free(im); free(rps);
+        free_fft_plan(&plan);
+        free_channel(channel, MEF_TRUE);
+        return(1);
+    }
+    rps->compression.mode = RED_DECOMPRESSION;
+    rps->password_data = channel->segments[0].metadata_fps->password_data;
+    rps->difference_buffer = (si1 *) e_calloc((size_t) RED_MAX_DIFFERENCE_BYTES(max_samps), sizeof(ui1), __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+
+    // Hann window; power_scale turns summed |X|^2 into one-sided band power
+    window_power = 0.0;
+    for (i = 0; i < window_samples; i++) {
+        hann[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i / (window_samples - 1));
+        window_power += hann[i] * hann[i];
+    }
+    power_scale = 2.0 / (fft_points * window_power);
+
+    sprintf(output_name, "%s/%s.features", job->output_dir, channel->name);
+    ofp = fopen(output_name, "wb");
+    if (ofp == NULL) {
+        fprintf(stdout, "[%s] Error opening %s for writing\n", __FUNCTION__, output_name);
+        free(in_data); free(data); free(ring); free(hann); free(re); free(im); free(rps->difference_buffer); free(rps);
+        free_fft_plan(&plan);
+        free_channel(channel, MEF_TRUE);
+        return(1);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FEATURES_MAGIC, 8);
+    header.sampling_frequency = fs;
+    header.window_samples = window_samples;
+    header.step_samples = step_samples;
+    header.fft_points = fft_points;
+    header.number_of_bands = NUMBER_OF_BANDS;
+    memcpy(header.band_edges, band_edges, sizeof(band_edges));
+    write_error = (fwrite(&header, sizeof(header), 1, ofp) != 1);
+
+    ring_pos = ring_filled = since_last_window = 0;
+    run_start_time = run_start_sample = run_samples = 0;
+    window_flags = 0;
+    n_windows = n_crc_errors = 0;
+
+    numSegments = channel->number_of_segments;
+
+    // iterate over segments
+    for (start_segment = 0; start_segment < numSegments && !write_error; start_segment++) {
+
+        if (channel->segments[start_segment].time_series_data_fps->fp == NULL) {
+            channel->segments[start_segment].time_series_data_fps->fp = fopen(channel->segments[start_segment].time_series_data_fps->full_file_name, "rb");
+            if (channel->segments[start_segment].time_series_data_fps->fp == NULL) {
+                fprintf(stdout, "[%s] Error opening %s\n", __FUNCTION__, channel->segments[start_segment].time_series_data_fps->full_file_name);
+                continue;
+            }
+#ifndef _WIN32
+            channel->segments[start_segment].time_series_data_fps->fd = fileno(channel->segments[start_segment].time_series_data_fps->fp);
+#else
+            channel->segments[start_segment].time_series_data_fps->fd = _fileno(channel->segments[start_segment].time_series_data_fps->fp);
+#endif
+        }
+        fp = channel->segments[start_segment].time_series_data_fps->fp;
+
+        numBlocks = channel->segments[start_segment].time_series_indices_fps->universal_header->number_of_entries;
+        // index start_sample values are relative to the segment
+        segment_start_sample = channel->segments[start_segment].metadata_fps->metadata.time_series_section_2->start_sample;
+
+        // iterate over blocks within a segment
+        for (start_block = 0; start_block < numBlocks && !write_error; start_block++) {
+
+            tsi = &channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_block];
+
+            if (tsi->block_bytes > inDataLength) {
+                n_crc_errors++;
+                window_flags |= 1;
+                continue;
+            }
+#ifndef _WIN32
+            fseek(fp, tsi->file_offset, SEEK_SET);
+#else
+            _fseeki64(fp, tsi->file_offset, SEEK_SET);
+#endif
+            if (fread(in_data, sizeof(si1), (size_t) tsi->block_bytes, fp) != tsi->block_bytes) {
+                n_crc_errors++;
+                window_flags |= 1;
+                continue;
+            }
+
+            rps->compressed_data = in_data;
+            rps->decompressed_ptr = data;
+            rps->block_header = (RED_BLOCK_HEADER *) rps->compressed_data;
+            if (!check_block_crc((ui1*)(rps->block_header), max_samps, in_data, inDataLength)) {
+                n_crc_errors++;
+                window_flags |= 1;
+                continue;
+            }
+
+            RED_decode_fast(rps);
+
+            block_flags = rps->block_header->flags;
+            temp_time = rps->block_header->start_time;
+            remove_recording_time_offset(&temp_time);
+
+            // Restart the sliding window at discontinuities, or wherever the block does not follow the previous one in time.
+            // window_flags is kept, so a dropped block (which always leaves such a gap) is flagged in the next record.
+            expected_time = run_start_time + (si8) (0.5 + (1e6 * run_samples) / fs);
+            if ((block_flags & RED_DISCONTINUITY_MASK) || run_samples == 0 ||
+                llabs(temp_time - expected_time) > (si8) (1e6 / fs)) {
+                run_start_time = temp_time;
+                run_start_sample = segment_start_sample + tsi->start_sample;
+                run_samples = 0;
+                ring_pos = ring_filled = since_last_window = 0;
+            }
+
+            for (i = 0; i < rps->block_header->number_of_samples; i++) {
+                ring[ring_pos] = (sf8) data[i] * ucf;
+                if (++ring_pos == window_samples)
+                    ring_pos = 0;
+                if (ring_filled < window_samples)
+                    ring_filled++;
+                run_samples++;
+                since_last_window++;
+
+                if (ring_filled < window_samples || since_last_window < step_samples)
+                    continue;
+                since_last_window = 0;
+
+                // unroll the ring (oldest sample is at ring_pos) into the FFT buffer
+                mean = 0.0;
+                line_length = 0.0;
+                for (j = 0, k = ring_pos; j < window_samples; j++) {
+                    re[j] = ring[k];
+                    mean += ring[k];
+                    if (j > 0)
+                        line_length += fabs(re[j] - re[j - 1]);
+                    if (++k == window_samples)
+                        k = 0;
+                }
+                mean /= window_samples;
+                for (j = 0; j < window_samples; j++) {
+                    re[j] = (re[j] - mean) * hann[j];
+                    im[j] = 0.0;
+                }
+                for (; j < fft_points; j++)
+                    re[j] = im[j] = 0.0;
+
+                execute_fft(&plan, re, im);
+
+                record.start_time = run_start_time + (si8) (0.5 + (1e6 * (run_samples - window_samples)) / fs);
+                record.start_sample = run_start_sample + run_samples - window_samples;
+                for (b = 0; b < NUMBER_OF_BANDS; b++) {
+                    power = 0.0;
+                    for (k = band_lo[b]; k < band_hi[b]; k++)
+                        power += re[k] * re[k] + im[k] * im[k];
+                    record.band_power[b] = (sf4) (power * power_scale);
+                }
+                record.line_length = (sf4) line_length;
+                record.flags = window_flags;
+                if (fwrite(&record, sizeof(record), 1, ofp) != 1) {
+                    write_error = 1;
+                    break;
+                }
+
+                window_flags = 0;
+                n_windows++;
+            }
+        }
+
+        if (channel->segments[start_segment].time_series_data_fps->fp != NULL) {
+            fclose(channel->segments[start_segment].time_series_data_fps->fp);
+            channel->segments[start_segment].time_series_data_fps->fp = NULL;
+        }
+    }
+
+    if (fclose(ofp))
+        write_error = 1;
+
+    if (write_error)
+        fprintf(stdout, "[%s] Error writing %s\n", __FUNCTION__, output_name);
+#ifndef _WIN32
+    else
+        fprintf(stdout, "%s: %ld windows written to %s, %ld unreadable blocks\n", job->channel_name, n_windows, output_name, n_crc_errors);
+#else
+    else
+        fprintf(stdout, "%s: %lld windows written to %s, %lld unreadable blocks\n", job->channel_name, n_windows, output_name, n_crc_errors);
+#endif
+
+    // clean up
+    free(in_data);
+    free(data);
+    free(ring);
+    free(hann);
+    free(re);
+    free(im);
+    free(rps->difference_buffer);
+    free(rps);
+    free_fft_plan(&plan);
+    free_channel(channel, MEF_TRUE);
+
+    return(write_error);
+}
+
+int main (int argc, const char * argv[]) {
+    si4 i, n_threads, n_failed, number_of_jobs;
+    si1 *password, *output_dir;
+    sf8 window_seconds, step_seconds;
+    FEATURE_JOB *jobs;
+
+    (void) initialize_meflib();
+    // pick the RED decode kernel before the workers start
+    RED_decode_fast_init();
+
+    password = NULL;
+    output_dir = ".";
+    window_seconds = DEFAULT_WINDOW_SECONDS;
+    step_seconds = DEFAULT_STEP_SECONDS;
+    n_threads = DEFAULT_THREADS;
+
+    if (argc < 2)
+    {
+        (void) printf("USAGE: %s chan_folder[s] [-p password] [-w window_seconds] [-s step_seconds] [-t threads] [-o output_dir]\n", argv[0]);
+        return(1);
+    }
+
+    jobs = (FEATURE_JOB *) calloc((size_t) argc, sizeof(FEATURE_JOB));
+    number_of_jobs = 0;
+
+    // parse options; everything that is not an option or option argument is a channel
+    i = 1;
+    while (i < argc)
+    {
+        if (*argv[i] == '-') {
+            if (i + 1 >= argc)
+            {
+                (void) printf("USAGE: %s chan_folder[s] [-p password] [-w window_seconds] [-s step_seconds] [-t threads] [-o output_dir]\n", argv[0]);
+                return(1);
+            }
+            switch (argv[i][1])
+            {
+                case 'p':
+                    password = (si1 *) argv[i+1];
+                    break;
+                case 'w':
+                    window_seconds = atof(argv[i+1]);
+                    break;
+                case 's':
+                    step_seconds = atof(argv[i+1]);
+                    break;
+                case 't':
+                    n_threads = atoi(argv[i+1]);
+                    break;
+                case 'o':
+                    output_dir = (si1 *) argv[i+1];
+                    break;
+            }
+            i += 2;
+            continue;
+        }
+        jobs[number_of_jobs++].channel_name = (si1 *) argv[i];
+        i++;
+    }
+
+    if (window_seconds <= 0.0 || step_seconds <= 0.0)
+    {
+        printf("Window and step must be positive.\n");
+        return(1);
+    }
+
+    for (i = 0; i < number_of_jobs; i++) {
+        jobs[i].password = password;
+        jobs[i].output_dir = output_dir;
+        jobs[i].window_seconds = window_seconds;
+        jobs[i].step_seconds = step_seconds;
+    }
+
+    n_failed = run_jobs(jobs, sizeof(FEATURE_JOB), number_of_jobs, n_threads, extract_channel_features);
+
+    printf("Done, %d of %d channels processed.\n", number_of_jobs - n_failed, number_of_jobs);
+
+    free(jobs);
+
+    return (n_failed ? 1 : 0);
+}
@@ -0,0 +1,146 @@
+/*
+ *  mef3_tools.c
+ *
+
+ Helpers shared by the MEF 3 analysis tools.  See mef3_tools.h.
+
+ Copyright 2020, Mayo Foundation, Rochester MN. All rights reserved.
+
+ This software is made freely available under the GNU public license: http://www.gnu.org/licenses/gpl-3.0.txt
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "mef3_tools.h"
+
+// meflib is not documented as thread-safe (it sets up CRC, AES and UTF8 tables and the recording time offset
+// lazily), so all channel opens go through this lock; decoding with per-thread buffers runs in parallel
+static pthread_mutex_t  meflib_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    ui1                 *jobs;
+    size_t              job_bytes;
+    si4                 number_of_jobs;
+    si4                 next_job;
+    si4                 n_failed;
+    MEF3_JOB_FUNCTION   function;
+    pthread_mutex_t     mutex;
+} JOB_POOL;
+
+
+int check_block_crc(ui1* block_hdr_ptr, ui4 max_samps, ui1* total_data_ptr, ui8 total_data_bytes)
+{
+    ui8 offset_into_data, remaining_buf_size;
+    si1 CRC_valid;
+    RED_BLOCK_HEADER* block_header;
+    
+    offset_into_data = block_hdr_ptr - total_data_ptr;
+    remaining_buf_size = total_data_bytes - offset_into_data;
+    
+    // check if remaining buffer at least contains the RED block header
+    if (remaining_buf_size < RED_BLOCK_HEADER_BYTES)
+        return 0;
+    
+    block_header = (RED_BLOCK_HEADER*) block_hdr_ptr;
+    
+    // check if entire block, based on size specified in header, can possibly fit in the remaining buffer
+    if (block_header->block_bytes > remaining_buf_size)
+        return 0;
+    
+    // check if size specified in header is absurdly large
+    if (block_header->block_bytes > RED_MAX_COMPRESSED_BYTES(max_samps, 1))
+        return 0;
+    
+    // at this point we know we have enough data to actually run the CRC calculation, so do it
+    CRC_valid = CRC_validate((ui1*) block_header + CRC_BYTES, block_header->block_bytes - CRC_BYTES, block_header->block_CRC);
+    
+    // return output of CRC heck
+    if (CRC_valid == MEF_TRUE)
+        return 1;
+    else
+        return 0;
+}
+
+CHANNEL *read_MEF_channel_serialized(si1 *channel_name, si1 *password)
+{
+    CHANNEL *channel;
+
+    pthread_mutex_lock(&meflib_mutex);
+    channel = read_MEF_channel(NULL, channel_name, TIME_SERIES_CHANNEL_TYPE, password, NULL, MEF_FALSE, MEF_FALSE);
+    pthread_mutex_unlock(&meflib_mutex);
+
+    return(channel);
+}
+
+static void *job_worker(void *arg)
+{
+    JOB_POOL *pool;
+    si4 job, result;
+
+    pool = (JOB_POOL *) arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        job = pool->next_job++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (job >= pool->number_of_jobs)
+            break;
+
+        result = pool->function(pool->jobs + (size_t) job * pool->job_bytes);
+
+        if (result) {
+            pthread_mutex_lock(&pool->mutex);
+            pool->n_failed++;
+            pthread_mutex_unlock(&pool->mutex);
+        }
+    }
+
+    return(NULL);
+}
+
+si4 run_jobs(void *jobs, size_t job_bytes, si4 number_of_jobs, si4 n_threads, MEF3_JOB_FUNCTION function)
+{
+    si4 i, n_started;
+    JOB_POOL pool;
+    pthread_t threads[MEF3_TOOLS_MAX_THREADS];
+
+    if (n_threads < 1) n_threads = 1;
+    if (n_threads > MEF3_TOOLS_MAX_THREADS) n_threads = MEF3_TOOLS_MAX_THREADS;
+    if (n_threads > number_of_jobs) n_threads = number_of_jobs;
+
+    pool.jobs = (ui1 *) jobs;
+    pool.job_bytes = job_bytes;
+    pool.number_of_jobs = number_of_jobs;
+    pool.next_job = 0;
+    pool.n_failed = 0;
+    pool.function = function;
+    pthread_mutex_init(&pool.mutex, NULL);
+
+    // if no thread can be started, the jobs are run on the calling thread
+    n_started = 0;
+    for (i = 0; i < n_threads; i++)
+        if (pthread_create(&threads[n_started], NULL, job_worker, &pool) == 0)
+            n_started++;
+    if (n_started == 0)
+        job_worker(&pool);
+    for (i = 0; i < n_started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&pool.mutex);
+
+    return(pool.n_failed);
+}
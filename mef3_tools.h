@@ -0,0 +1,32 @@
+/*
+ *  mef3_tools.h
+ *
+
+ Helpers shared by the MEF 3 analysis tools: block CRC checking, serialized channel opens, and the worker pool
+ used to process channels in parallel.  Compile mef3_tools.c in with the tool and link with -lpthread.
+
+ Copyright 2020, Mayo Foundation, Rochester MN. All rights reserved.
+
+ This software is made freely available under the GNU public license: http://www.gnu.org/licenses/gpl-3.0.txt
+
+ */
+
+#ifndef MEF3_TOOLS_IN
+#define MEF3_TOOLS_IN
+
+#include "meflib.h"
+
+#define MEF3_TOOLS_MAX_THREADS      256
+
+// Returns 1 if the block at block_hdr_ptr fits in the buffer and passes its CRC check, 0 otherwise.
+int     check_block_crc(ui1* block_hdr_ptr, ui4 max_samps, ui1* total_data_ptr, ui8 total_data_bytes);
+
+// read_MEF_channel() for a time series channel, safe to call from several threads at once.
+CHANNEL *read_MEF_channel_serialized(si1 *channel_name, si1 *password);
+
+// Calls function(job) for each of number_of_jobs jobs, which are job_bytes apart starting at jobs, using up to
+// n_threads worker threads.  Returns the number of jobs for which function returned nonzero.
+typedef si4 (*MEF3_JOB_FUNCTION)(void *job);
+si4     run_jobs(void *jobs, size_t job_bytes, si4 number_of_jobs, si4 n_threads, MEF3_JOB_FUNCTION function);
+
+#endif
@@ -4,6 +4,9 @@
  
  Program to read mef format file (v3.0) and output samples/timestamps to standard out.
  
+ With -f, the program instead follows a channel that is still being recorded: it waits for blocks to be appended to
+ the active segment and writes each new block's samples to standard out as soon as the block is complete.
+ 
  Copyright 2020, Mayo Foundation, Rochester MN. All rights reserved.
  
  This software is made freely available under the GNU public license: http://www.gnu.org/licenses/gpl-3.0.txt
@@ -23,49 +26,279 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include "meflib.h"
+#include "red_decode_fast.h"
+#include "mef3_tools.h"
 
 MEF_GLOBALS	*MEF_globals;
 
-int check_block_crc(ui1* block_hdr_ptr, ui4 max_samps, ui1* total_data_ptr, ui8 total_data_bytes)
+// blocks read and decoded together, so RED_decode_fast_blocks() can work on several at once
+#define READ_BATCH_BLOCKS       16
+// follow mode: wake at least this often even if no file change notification arrives
+#define FOLLOW_POLL_MS          100
+// a complete block that still fails its CRC is retried this many times before being reported, in case its bytes
+// are not all visible yet
+#define FOLLOW_CRC_RETRIES      20
+
+#ifndef _WIN32
+static volatile sig_atomic_t follow_stop = 0;
+
+void follow_signal_handler(int sig)
 {
-    ui8 offset_into_data, remaining_buf_size;
-    si1 CRC_valid;
-    RED_BLOCK_HEADER* block_header;
+    follow_stop = 1;
+}
+
+// open the index and data files of one segment and arm change notification on them; watches[] gets the two watch
+// descriptors (-1 without notification)
+int follow_open_segment(si1 *tidx_name, si1 *tdat_name, si4 *tidx_fd, si4 *tdat_fd, si4 notify_fd, si4 *watches)
+{
+    watches[0] = watches[1] = -1;
+    *tidx_fd = open(tidx_name, O_RDONLY);
+    *tdat_fd = open(tdat_name, O_RDONLY);
+    if (*tidx_fd < 0 || *tdat_fd < 0) {
+        fprintf(stdout, "Error opening %s or %s\n", tidx_name, tdat_name);
+        if (*tidx_fd >= 0) close(*tidx_fd);
+        if (*tdat_fd >= 0) close(*tdat_fd);
+        return(1);
+    }
+#ifdef __linux__
+    if (notify_fd >= 0) {
+        watches[0] = inotify_add_watch(notify_fd, tidx_name, IN_MODIFY);
+        watches[1] = inotify_add_watch(notify_fd, tdat_name, IN_MODIFY);
+    }
+#endif
+    return(0);
+}
+
+// close a segment opened by follow_open_segment() and drop its watches
+void follow_close_segment(si4 tidx_fd, si4 tdat_fd, si4 notify_fd, si4 *watches)
+{
+#ifdef __linux__
+    if (notify_fd >= 0) {
+        if (watches[0] >= 0) inotify_rm_watch(notify_fd, watches[0]);
+        if (watches[1] >= 0) inotify_rm_watch(notify_fd, watches[1]);
+    }
+#endif
+    watches[0] = watches[1] = -1;
+    if (tidx_fd >= 0) close(tidx_fd);
+    if (tdat_fd >= 0) close(tdat_fd);
+}
+
+// Follow the last segment of a live channel.  Only complete index entries whose block is entirely present in the
+// data file and passes its CRC are decoded; anything else is left for the next wake-up.  Starts at the current end
+// of the segment, like tail -f, and moves on to the next segment when the recorder creates one.
+int follow_channel(CHANNEL *channel)
+{
+    si4 i, segment_number, tidx_fd, tdat_fd, next_tidx_fd, next_tdat_fd, notify_fd, crc_retries;
+    si4 watches[2], next_watches[2], next_segd_watch;
+    si8 next_entry, available_entries;
+    ui4 max_samps, data_samples;
+    ui8 inDataLength;
+    si4 *data;
+    ui1 *in_data;
+    si1 tidx_name[MEF_FULL_FILE_NAME_BYTES], tdat_name[MEF_FULL_FILE_NAME_BYTES], channel_dir[MEF_FULL_FILE_NAME_BYTES];
+    si1 next_tidx[MEF_FULL_FILE_NAME_BYTES], next_tdat[MEF_FULL_FILE_NAME_BYTES], next_segd[MEF_FULL_FILE_NAME_BYTES], *slash;
+    ui1 notify_events[4096];
+    struct stat tidx_stat, tdat_stat, next_stat;
+    struct pollfd pfd;
+    TIME_SERIES_INDEX tsi;
+    RED_PROCESSING_STRUCT *rps;
+    SEGMENT *segment;
     
-    offset_into_data = block_hdr_ptr - total_data_ptr;
-    remaining_buf_size = total_data_bytes - offset_into_data;
+    segment = &channel->segments[channel->number_of_segments - 1];
+    segment_number = segment->time_series_indices_fps->universal_header->segment_number;
+    strcpy(tidx_name, segment->time_series_indices_fps->full_file_name);
+    strcpy(tdat_name, segment->time_series_data_fps->full_file_name);
     
-    // check if remaining buffer at least contains the RED block header
-    if (remaining_buf_size < RED_BLOCK_HEADER_BYTES)
-        return 0;
+    // channel directory is two levels above the index file: <channel>.timd/<segment>.segd/<segment>.tidx
+    strcpy(channel_dir, tidx_name);
+    if ((slash = strrchr(channel_dir, '/')) != NULL) *slash = 0;
+    if ((slash = strrchr(channel_dir, '/')) != NULL) *slash = 0;
     
-    block_header = (RED_BLOCK_HEADER*) block_hdr_ptr;
+    // The channel directory watch sees the next .segd being created, and a watch on that .segd, added once it
+    // exists, sees its index and data files appear.  Watches on a finished segment are removed when moving on.
+    notify_fd = -1;
+    next_segd_watch = -1;
+#ifdef __linux__
+    notify_fd = inotify_init1(IN_NONBLOCK);
+    if (notify_fd >= 0)
+        inotify_add_watch(notify_fd, channel_dir, IN_CREATE | IN_MOVED_TO);
+#endif
+    if (notify_fd < 0)
+        fprintf(stdout, "File change notification unavailable, polling every %d ms\n", FOLLOW_POLL_MS);
     
-    // check if entire block, based on size specified in header, can possibly fit in the remaining buffer
-    if (block_header->block_bytes > remaining_buf_size)
-        return 0;
+    if (follow_open_segment(tidx_name, tdat_name, &tidx_fd, &tdat_fd, notify_fd, watches))
+    {
+        if (notify_fd >= 0) close(notify_fd);
+        return(1);
+    }
     
-    // check if size specified in header is absurdly large
-    if (block_header->block_bytes > RED_MAX_COMPRESSED_BYTES(max_samps, 1))
-        return 0;
+    // start at the current end of the segment
+    fstat(tidx_fd, &tidx_stat);
+    next_entry = (tidx_stat.st_size - UNIVERSAL_HEADER_BYTES) / TIME_SERIES_INDEX_BYTES;
+    if (next_entry < 0) next_entry = 0;
     
-    // at this point we know we have enough data to actually run the CRC calculation, so do it
-    CRC_valid = CRC_validate((ui1*) block_header + CRC_BYTES, block_header->block_bytes - CRC_BYTES, block_header->block_CRC);
+    // buffers grow if the recorder writes larger blocks than the metadata described when the channel was opened
+    inDataLength = channel->metadata.time_series_section_2->maximum_block_bytes;
+    in_data = malloc(inDataLength);
+    data_samples = max_samps = channel->metadata.time_series_section_2->maximum_block_samples;
+    data = calloc(data_samples, sizeof(si4));
+    rps = (RED_PROCESSING_STRUCT *) calloc((size_t) 1, sizeof(RED_PROCESSING_STRUCT));
+    rps->compression.mode = RED_DECOMPRESSION;
+    rps->password_data = channel->segments[0].metadata_fps->password_data;
+    rps->difference_buffer = (si1 *) e_calloc((size_t) RED_MAX_DIFFERENCE_BYTES(max_samps), sizeof(ui1), __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
     
-    // return output of CRC heck
-    if (CRC_valid == MEF_TRUE)
-        return 1;
-    else
-        return 0;
+    signal(SIGINT, follow_signal_handler);
+    signal(SIGTERM, follow_signal_handler);
+    
+    fprintf(stdout, "\nFollowing segment %d of channel %s, starting at block %ld\n", segment_number, channel->name, next_entry);
+    fflush(stdout);
+    
+    crc_retries = 0;
+    while (!follow_stop) {
+        
+        // partially written index entries are not counted
+        fstat(tidx_fd, &tidx_stat);
+        available_entries = (tidx_stat.st_size - UNIVERSAL_HEADER_BYTES) / TIME_SERIES_INDEX_BYTES;
+        
+        while (next_entry < available_entries && !follow_stop) {
+            
+            if (pread(tidx_fd, &tsi, TIME_SERIES_INDEX_BYTES, UNIVERSAL_HEADER_BYTES + next_entry * TIME_SERIES_INDEX_BYTES) != TIME_SERIES_INDEX_BYTES)
+                break;
+            
+            // block not completely written yet
+            fstat(tdat_fd, &tdat_stat);
+            if (tsi.file_offset + (si8) tsi.block_bytes > tdat_stat.st_size)
+                break;
+            
+            if (tsi.block_bytes > inDataLength) {
+                free(in_data);
+                in_data = malloc(tsi.block_bytes);
+                inDataLength = tsi.block_bytes;
+            }
+            if (tsi.number_of_samples > data_samples) {
+                free(data);
+                data = calloc(tsi.number_of_samples, sizeof(si4));
+                free(rps->difference_buffer);
+                rps->difference_buffer = (si1 *) e_calloc((size_t) RED_MAX_DIFFERENCE_BYTES(tsi.number_of_samples), sizeof(ui1), __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+                data_samples = max_samps = tsi.number_of_samples;
+            }
+            
+            if (pread(tdat_fd, in_data, tsi.block_bytes, tsi.file_offset) != (ssize_t) tsi.block_bytes)
+                break;
+            
+            rps->compressed_data = in_data;
+            rps->decompressed_ptr = data;
+            rps->block_header = (RED_BLOCK_HEADER *) rps->compressed_data;
+            if (!check_block_crc((ui1*)(rps->block_header), max_samps, in_data, tsi.block_bytes))
+            {
+                // the bytes may still be in flight; only give up after several wake-ups
+                if (++crc_retries < FOLLOW_CRC_RETRIES)
+                    break;
+                fprintf(stdout, "**CRC block failure!**\n");
+                fflush(stdout);
+                crc_retries = 0;
+                next_entry++;
+                continue;
+            }
+            crc_retries = 0;
+            
+            RED_decode_fast(rps);
+            
+            fprintf(stdout, "\nNew Block, size = %d time = %lu\n\n",
+                    rps->block_header->number_of_samples,
+                    rps->block_header->start_time);
+            for (i = 0; i < rps->block_header->number_of_samples; i++)
+                fprintf(stdout, "%d\n", data[i]);
+            fflush(stdout);
+            
+            next_entry++;
+        }
+        
+        // once the active segment is drained, move on if the recorder has started the next one
+        if (next_entry >= available_entries) {
+            sprintf(next_segd, "%s/%s-%06d.segd", channel_dir, channel->name, segment_number + 1);
+#ifdef __linux__
+            if (notify_fd >= 0 && next_segd_watch < 0 && stat(next_segd, &next_stat) == 0)
+                next_segd_watch = inotify_add_watch(notify_fd, next_segd, IN_CREATE | IN_MOVED_TO);
+#endif
+            sprintf(next_tidx, "%s/%s-%06d.segd/%s-%06d.tidx", channel_dir, channel->name, segment_number + 1, channel->name, segment_number + 1);
+            sprintf(next_tdat, "%s/%s-%06d.segd/%s-%06d.tdat", channel_dir, channel->name, segment_number + 1, channel->name, segment_number + 1);
+            // the recorder creates the index before the data file; wait until both exist
+            if (stat(next_tidx, &next_stat) == 0 && stat(next_tdat, &next_stat) == 0) {
+                // blocks may have been appended to this segment after available_entries was read; drain them first
+                fstat(tidx_fd, &tidx_stat);
+                if ((tidx_stat.st_size - UNIVERSAL_HEADER_BYTES) / TIME_SERIES_INDEX_BYTES > next_entry)
+                    continue;
+                // if the new segment cannot be opened yet, keep the current one and try again on the next wake-up
+                if (follow_open_segment(next_tidx, next_tdat, &next_tidx_fd, &next_tdat_fd, notify_fd, next_watches) == 0) {
+                    follow_close_segment(tidx_fd, tdat_fd, notify_fd, watches);
+#ifdef __linux__
+                    if (next_segd_watch >= 0) {
+                        inotify_rm_watch(notify_fd, next_segd_watch);
+                        next_segd_watch = -1;
+                    }
+#endif
+                    watches[0] = next_watches[0];
+                    watches[1] = next_watches[1];
+                    tidx_fd = next_tidx_fd;
+                    tdat_fd = next_tdat_fd;
+                    segment_number++;
+                    strcpy(tidx_name, next_tidx);
+                    strcpy(tdat_name, next_tdat);
+                    next_entry = 0;
+                    crc_retries = 0;
+                    fprintf(stdout, "\nNew Segment, segment %d\n", segment_number);
+                    fflush(stdout);
+                    continue;
+                }
+            }
+        }
+        
+        // wait for a change notification, or the poll interval
+        if (notify_fd >= 0) {
+            pfd.fd = notify_fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, FOLLOW_POLL_MS) > 0)
+                while (read(notify_fd, notify_events, sizeof(notify_events)) > 0);
+        }
+        else
+            poll(NULL, 0, FOLLOW_POLL_MS);
+    }
+    
+    follow_close_segment(tidx_fd, tdat_fd, notify_fd, watches);
+    // closing the inotify descriptor drops the remaining watches
+    if (notify_fd >= 0)
+        close(notify_fd);
+    
+    // clean up
+    free(in_data);
+    free(data);
+    free(rps->difference_buffer);
+    free(rps);
+    
+    fprintf(stdout, "Follow stopped\n");
+    
+    return(0);
 }
+#endif
 
 int main (int argc, const char * argv[]) {
-    si4 i, numBlocks, start_block;
-    si4 *data;
+    si4 i, b, numBlocks, start_block, n_batch, first_block_slot;
+    si4 *data[READ_BATCH_BLOCKS];
     ui8 inDataLength, outDataLength;
-    ui1 *in_data;
+    ui1 *in_data[READ_BATCH_BLOCKS];
     si4 numSegments, start_segment;
     si8 temp_time;
     
@@ -74,12 +307,23 @@ int main (int argc, const char * argv[]) {
     ui4			max_samps;
     FILE *fp;
     si4 n_read;
+    si4 follow;
     
     (void) initialize_meflib();
+    RED_decode_fast_init();
+    
+    // -f as the first argument selects follow mode
+    follow = 0;
+    if (argc > 1 && strcmp(argv[1], "-f") == 0)
+    {
+        follow = 1;
+        argv++;
+        argc--;
+    }
     
     if (argc < 2 || argc > 3)
     {
-        (void) printf("USAGE: %s channel_name [password] \n", argv[0]);
+        (void) printf("USAGE: %s [-f] channel_name [password] \n", argv[0]);
         return(1);
     }
     
@@ -91,24 +335,39 @@ int main (int argc, const char * argv[]) {
     else
         channel = read_MEF_channel(NULL, argv[1], TIME_SERIES_CHANNEL_TYPE, NULL, NULL, MEF_FALSE, MEF_FALSE);
     
+    // error checking
+    if (channel == NULL) {
+        fprintf(stdout, "Error opening channel\n");
+        return (0);
+    }
+    
+    if (follow) {
+#ifndef _WIN32
+        return(follow_channel(channel));
+#else
+        fprintf(stdout, "Follow mode is not supported on Windows\n");
+        return(1);
+#endif
+    }
+    
     inDataLength = channel->metadata.time_series_section_2->maximum_block_bytes;
-    in_data = malloc(inDataLength);
     outDataLength = max_samps = channel->metadata.time_series_section_2->maximum_block_samples;
-    data = calloc(outDataLength, sizeof(ui4));
+    for (b = 0; b < READ_BATCH_BLOCKS; b++) {
+        in_data[b] = malloc(inDataLength);
+        data[b] = calloc(outDataLength, sizeof(ui4));
+        if (in_data[b] == NULL || data[b] == NULL) {
+            fprintf(stdout, "Error allocating block buffers\n");
+            return(1);
+        }
+    }
     
     // create RED processing struct
     rps = (RED_PROCESSING_STRUCT *) calloc((size_t) 1, sizeof(RED_PROCESSING_STRUCT));
     rps->compression.mode = RED_DECOMPRESSION;
     //rps->directives.return_block_extrema = MEF_TRUE;
-    rps->decompressed_data = in_data;
+    rps->password_data = channel->segments[0].metadata_fps->password_data;
     rps->difference_buffer = (si1 *) e_calloc((size_t) RED_MAX_DIFFERENCE_BYTES(max_samps), sizeof(ui1), __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
     
-    // error checking
-    if (channel == NULL) {
-        fprintf(stdout, "Error opening channel\n");
-        return (0);
-    }
-    
     numSegments = channel->number_of_segments;
     start_segment = 0;
     
@@ -149,31 +408,45 @@ int main (int argc, const char * argv[]) {
         
         start_block = 0;
         
-        // iterate over blocks within a segment
+        // iterate over blocks within a segment, READ_BATCH_BLOCKS at a time
+        fp = channel->segments[start_segment].time_series_data_fps->fp;
         while( start_block < numBlocks ) {
             
-            fp = channel->segments[start_segment].time_series_data_fps->fp;
+            // read a batch of blocks that pass their CRC check
+            n_batch = 0;
+            first_block_slot = -1;
+            while (n_batch < READ_BATCH_BLOCKS && start_block < numBlocks) {
+                if (channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_block].block_bytes > inDataLength)
+                {
+                    fprintf(stdout, "**CRC block failure!**\n");
+                    start_block++;
+                    continue;
+                }
 #ifndef _WIN32
-            fseek(fp, channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_block].file_offset, SEEK_SET);
+                fseek(fp, channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_block].file_offset, SEEK_SET);
 #else
-            _fseeki64(fp, channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_block].file_offset, SEEK_SET);
+                _fseeki64(fp, channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_block].file_offset, SEEK_SET);
 #endif
-            n_read = fread(in_data, sizeof(si1), (size_t) channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_block].block_bytes, fp);
-            
-            rps->compressed_data = in_data;
-            rps->decompressed_ptr = data;
-            rps->block_header = (RED_BLOCK_HEADER *) rps->compressed_data;
-            if (!check_block_crc((ui1*)(rps->block_header), max_samps, in_data, inDataLength))
-            {
-                fprintf(stdout, "**CRC block failure!**\n");
+                n_read = fread(in_data[n_batch], sizeof(si1), (size_t) channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_block].block_bytes, fp);
+                
+                if (!check_block_crc(in_data[n_batch], max_samps, in_data[n_batch], inDataLength))
+                {
+                    fprintf(stdout, "**CRC block failure!**\n");
+                    start_block++;
+                    continue;
+                }
+                
+                if (start_block == 0)
+                    first_block_slot = n_batch;
+                n_batch++;
                 start_block++;
-                continue;
             }
-
-            RED_decode(rps);
             
-            if (start_block == 0)
+            RED_decode_fast_blocks(rps, in_data, data, n_batch);
+            
+            if (first_block_slot >= 0)
             {
+                rps->block_header = (RED_BLOCK_HEADER *) in_data[first_block_slot];
 #ifndef _WIN32
                 fprintf(stdout, "\nNew Block, size = %d time = %lu\n\n",
                     rps->block_header->number_of_samples,
@@ -185,10 +458,8 @@ int main (int argc, const char * argv[]) {
 #endif
 
                 for (i = 0; i < rps->block_header->number_of_samples; i++)
-                    fprintf(stdout, "%d\n", data[i]);
+                    fprintf(stdout, "%d\n", data[first_block_slot][i]);
             }
-            
-            start_block++;
         }
 
         if (channel->segments[start_segment].time_series_data_fps->fp != NULL)
@@ -198,8 +469,11 @@ int main (int argc, const char * argv[]) {
     }
     
     // clean up
-    free(in_data);
-    free(data);
+    for (b = 0; b < READ_BATCH_BLOCKS; b++) {
+        free(in_data[b]);
+        free(data[b]);
+    }
+    free(rps->difference_buffer);
     free(rps);
     
     fprintf(stdout, "Decompression complete\n");
@@ -0,0 +1,552 @@
+/*
+ *  red_decode_fast.c
+ *
+
+ Faster RED block decoding for the analysis tools.  See red_decode_fast.h.
+
+ Copyright 2020, Mayo Foundation, Rochester MN. All rights reserved.
+
+ This software is made freely available under the GNU public license: http://www.gnu.org/licenses/gpl-3.0.txt
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "red_decode_fast.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RED_FAST_X86
+#include <immintrin.h>
+#endif
+
+// range coder constants, as used by RED
+#define RED_FAST_EXTRA_BITS     7
+#define RED_FAST_BOTTOM_VALUE   ((ui4) 0x00800000)
+
+// number of range decoders RED_decode_fast_blocks() runs side by side
+#define RED_FAST_INTERLEAVE     4
+// slack after each difference buffer, so a vector load near the end of a malformed block stays inside the buffer
+#define RED_FAST_PAD_BYTES      32
+
+// Shared by all decoding threads.  The tools pick the kernel in main() before starting workers; the self-check may
+// still switch it to RED_FAST_KERNEL_MEFLIB from any thread.
+static atomic_int fast_kernel = -1;
+static atomic_uint fast_blocks_decoded = 0;
+static atomic_uint fast_verify_blocks = RED_FAST_VERIFY_BLOCKS;
+static atomic_uint fast_verify_interval = RED_FAST_VERIFY_INTERVAL;
+
+typedef struct {
+    ui4 cnts[256], cum_cnts[257], total_counts;
+    ui4 low_bound, range, remaining;
+    ui1 in_byte, *ib_p, *ib_end;
+    si1 *out;
+} RANGE_DECODER;
+
+
+// ************************
+// Reconstruction kernels.  A RED difference buffer holds one signed byte per sample, the difference from the
+// previous sample, except that RED_KEYSAMPLE_FLAG is followed by a 4-byte absolute sample value.
+// ************************
+
+void RED_reconstruct_scalar(si1 *differences, si4 *samples, ui4 n_samples)
+{
+    si1 *p;
+    si4 current_val;
+
+    p = differences;
+    current_val = 0;
+    while (n_samples--) {
+        if (*p == RED_KEYSAMPLE_FLAG) {
+            memcpy(&current_val, p + 1, sizeof(si4));
+            p += 5;
+        }
+        else
+            current_val = (si4) ((ui4) current_val + (ui4) (si4) *p++);
+        *samples++ = current_val;
+    }
+}
+
+#ifdef RED_FAST_X86
+
+// Each iteration looks at the next 16 (SSE4.1) or 32 (AVX2) difference bytes.  When none is a keysample flag they
+// are all plain differences, so they are widened and prefix-summed in registers.  Otherwise the plain differences
+// before the first flag are prefix-summed the same way and the keysample is copied in, and the next iteration starts
+// just past it.  Loads and stores only happen while at least that many samples remain, and every sample takes at
+// least one byte, so they never go past the block's differences or samples.
+
+__attribute__((target("sse4.1")))
+static inline __m128i prefix_sum_4_sse41(__m128i x, __m128i carry)
+{
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+    return(_mm_add_epi32(x, carry));
+}
+
+__attribute__((target("sse4.1")))
+static void reconstruct_sse41(si1 *differences, si4 *samples, ui4 n_samples)
+{
+    si1 *p;
+    si4 current_val, w;
+    ui4 mask, k, g;
+    __m128i bytes, x, carry, flag;
+
+    p = differences;
+    current_val = 0;
+    flag = _mm_set1_epi8((char) RED_KEYSAMPLE_FLAG);
+
+    while (n_samples >= 16) {
+        bytes = _mm_loadu_si128((__m128i *) p);
+        mask = (ui4) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, flag));
+        if (mask == 0) {
+            carry = _mm_set1_epi32(current_val);
+            x = prefix_sum_4_sse41(_mm_cvtepi8_epi32(bytes), carry);
+            _mm_storeu_si128((__m128i *) samples, x);
+            carry = _mm_shuffle_epi32(x, 0xFF);
+            x = prefix_sum_4_sse41(_mm_cvtepi8_epi32(_mm_srli_si128(bytes, 4)), carry);
+            _mm_storeu_si128((__m128i *) (samples + 4), x);
+            carry = _mm_shuffle_epi32(x, 0xFF);
+            x = prefix_sum_4_sse41(_mm_cvtepi8_epi32(_mm_srli_si128(bytes, 8)), carry);
+            _mm_storeu_si128((__m128i *) (samples + 8), x);
+            carry = _mm_shuffle_epi32(x, 0xFF);
+            x = prefix_sum_4_sse41(_mm_cvtepi8_epi32(_mm_srli_si128(bytes, 12)), carry);
+            _mm_storeu_si128((__m128i *) (samples + 12), x);
+            current_val = _mm_cvtsi128_si32(_mm_shuffle_epi32(x, 0xFF));
+            p += 16;
+            samples += 16;
+            n_samples -= 16;
+            continue;
+        }
+
+        // keysample escape: the plain differences before the flag are summed in registers as above (the lanes
+        // past the flag are overwritten below), then the keysample value is copied in
+        k = __builtin_ctz(mask);
+        if (k) {
+            carry = _mm_set1_epi32(current_val);
+            for (g = 0; g < k; g += 4) {
+                memcpy(&w, p + g, sizeof(si4));
+                x = prefix_sum_4_sse41(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(w)), carry);
+                _mm_storeu_si128((__m128i *) (samples + g), x);
+                carry = _mm_shuffle_epi32(x, 0xFF);
+            }
+        }
+        memcpy(&current_val, p + k + 1, sizeof(si4));
+        samples[k] = current_val;
+        p += k + 5;
+        samples += k + 1;
+        n_samples -= k + 1;
+    }
+
+    while (n_samples--) {
+        if (*p == RED_KEYSAMPLE_FLAG) {
+            memcpy(&current_val, p + 1, sizeof(si4));
+            p += 5;
+        }
+        else
+            current_val = (si4) ((ui4) current_val + (ui4) (si4) *p++);
+        *samples++ = current_val;
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i prefix_sum_8_avx2(__m256i x, __m256i carry)
+{
+    // prefix within each 128-bit lane, then carry the low lane's total into the high lane
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    x = _mm256_add_epi32(x, _mm256_permute2x128_si256(_mm256_shuffle_epi32(x, 0xFF), _mm256_shuffle_epi32(x, 0xFF), 0x08));
+    return(_mm256_add_epi32(x, carry));
+}
+
+__attribute__((target("avx2")))
+static void reconstruct_avx2(si1 *differences, si4 *samples, ui4 n_samples)
+{
+    si1 *p;
+    si4 current_val, g;
+    ui4 mask, k;
+    __m256i bytes, x, carry, flag, last;
+
+    p = differences;
+    current_val = 0;
+    flag = _mm256_set1_epi8((char) RED_KEYSAMPLE_FLAG);
+    last = _mm256_set1_epi32(7);
+
+    while (n_samples >= 32) {
+        bytes = _mm256_loadu_si256((__m256i *) p);
+        mask = (ui4) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, flag));
+        if (mask == 0) {
+            carry = _mm256_set1_epi32(current_val);
+            for (g = 0; g < 32; g += 8) {
+                x = prefix_sum_8_avx2(_mm256_cvtepi8_epi32(_mm_loadl_epi64((__m128i *) (p + g))), carry);
+                _mm256_storeu_si256((__m256i *) (samples + g), x);
+                carry = _mm256_permutevar8x32_epi32(x, last);
+            }
+            current_val = _mm256_cvtsi256_si32(carry);
+            p += 32;
+            samples += 32;
+            n_samples -= 32;
+            continue;
+        }
+
+        // keysample escape: the plain differences before the flag are summed in registers as above (the lanes
+        // past the flag are overwritten below), then the keysample value is copied in
+        k = __builtin_ctz(mask);
+        if (k) {
+            carry = _mm256_set1_epi32(current_val);
+            for (g = 0; g < (si4) k; g += 8) {
+                x = prefix_sum_8_avx2(_mm256_cvtepi8_epi32(_mm_loadl_epi64((__m128i *) (p + g))), carry);
+                _mm256_storeu_si256((__m256i *) (samples + g), x);
+                carry = _mm256_permutevar8x32_epi32(x, last);
+            }
+        }
+        memcpy(&current_val, p + k + 1, sizeof(si4));
+        samples[k] = current_val;
+        p += k + 5;
+        samples += k + 1;
+        n_samples -= k + 1;
+    }
+
+    while (n_samples--) {
+        if (*p == RED_KEYSAMPLE_FLAG) {
+            memcpy(&current_val, p + 1, sizeof(si4));
+            p += 5;
+        }
+        else
+            current_val = (si4) ((ui4) current_val + (ui4) (si4) *p++);
+        *samples++ = current_val;
+    }
+}
+
+#endif  // RED_FAST_X86
+
+void RED_reconstruct(si4 kernel, si1 *differences, si4 *samples, ui4 n_samples)
+{
+    switch (kernel) {
+#ifdef RED_FAST_X86
+        case RED_FAST_KERNEL_AVX2:
+            reconstruct_avx2(differences, samples, n_samples);
+            return;
+        case RED_FAST_KERNEL_SSE41:
+            reconstruct_sse41(differences, samples, n_samples);
+            return;
+#endif
+        default:
+            RED_reconstruct_scalar(differences, samples, n_samples);
+            return;
+    }
+}
+
+
+// ************************
+// Kernel selection
+// ************************
+
+static si4 kernel_available(si4 kernel)
+{
+    switch (kernel) {
+        case RED_FAST_KERNEL_MEFLIB:
+        case RED_FAST_KERNEL_SCALAR:
+            return(MEF_TRUE);
+#ifdef RED_FAST_X86
+        case RED_FAST_KERNEL_SSE41:
+            return(__builtin_cpu_supports("sse4.1") ? MEF_TRUE : MEF_FALSE);
+        case RED_FAST_KERNEL_AVX2:
+            return(__builtin_cpu_supports("avx2") ? MEF_TRUE : MEF_FALSE);
+#endif
+        default:
+            return(MEF_FALSE);
+    }
+}
+
+void RED_decode_fast_init(void)
+{
+    si1 *env;
+    si4 kernel, best;
+
+#ifdef RED_FAST_X86
+    __builtin_cpu_init();
+#endif
+
+    if (kernel_available(RED_FAST_KERNEL_AVX2))
+        best = RED_FAST_KERNEL_AVX2;
+    else if (kernel_available(RED_FAST_KERNEL_SSE41))
+        best = RED_FAST_KERNEL_SSE41;
+    else
+        best = RED_FAST_KERNEL_SCALAR;
+
+    env = getenv("RED_DECODE_KERNEL");
+    if (env != NULL) {
+        for (kernel = RED_FAST_KERNEL_MEFLIB; kernel <= RED_FAST_KERNEL_AVX2; kernel++)
+            if (strcmp(env, RED_decode_fast_kernel_name(kernel)) == 0)
+                break;
+        if (kernel <= RED_FAST_KERNEL_AVX2 && kernel_available(kernel))
+            best = kernel;
+        else
+            fprintf(stderr, "[%s] RED_DECODE_KERNEL=%s is not available, using %s\n", __FUNCTION__, env, RED_decode_fast_kernel_name(best));
+    }
+
+    atomic_store(&fast_kernel, best);
+}
+
+si4 RED_decode_fast_set_kernel(si4 kernel)
+{
+    if (atomic_load(&fast_kernel) < 0)
+        RED_decode_fast_init();
+    if (!kernel_available(kernel))
+        return(MEF_FALSE);
+    atomic_store(&fast_kernel, kernel);
+    return(MEF_TRUE);
+}
+
+si4 RED_decode_fast_kernel(void)
+{
+    if (atomic_load(&fast_kernel) < 0)
+        RED_decode_fast_init();
+    return(atomic_load(&fast_kernel));
+}
+
+const si1 *RED_decode_fast_kernel_name(si4 kernel)
+{
+    switch (kernel) {
+        case RED_FAST_KERNEL_MEFLIB: return("meflib");
+        case RED_FAST_KERNEL_SCALAR: return("scalar");
+        case RED_FAST_KERNEL_SSE41:  return("sse4");
+        case RED_FAST_KERNEL_AVX2:   return("avx2");
+        default:                     return("unknown");
+    }
+}
+
+void RED_decode_fast_set_verify(si4 n_blocks, si4 interval)
+{
+    atomic_store(&fast_verify_blocks, (ui4) n_blocks);
+    atomic_store(&fast_verify_interval, (ui4) interval);
+}
+
+
+// ************************
+// Block decoding
+// ************************
+
+// Set up a range decoder for the block's differences.  Returns MEF_FALSE if the block cannot be decoded here.
+static si4 range_decoder_start(RANGE_DECODER *rd, RED_BLOCK_HEADER *block_header, si1 *differences)
+{
+    ui4 i;
+
+    rd->cum_cnts[0] = 0;
+    for (i = 0; i < 256; i++) {
+        rd->cnts[i] = block_header->statistics[i];
+        rd->cum_cnts[i + 1] = rd->cum_cnts[i] + rd->cnts[i];
+    }
+    rd->total_counts = rd->cum_cnts[256];
+    if (rd->total_counts == 0)
+        return(MEF_FALSE);
+
+    rd->ib_p = (ui1 *) block_header + RED_BLOCK_HEADER_BYTES;
+    rd->ib_end = (ui1 *) block_header + block_header->block_bytes;
+    rd->out = differences;
+    rd->remaining = block_header->difference_bytes;
+
+    rd->in_byte = *rd->ib_p++;
+    rd->low_bound = rd->in_byte >> (8 - RED_FAST_EXTRA_BITS);
+    rd->range = (ui4) 1 << RED_FAST_EXTRA_BITS;
+
+    return(MEF_TRUE);
+}
+
+// Decode one difference byte.
+static inline void range_decoder_step(RANGE_DECODER *rd)
+{
+    ui4 lo, step, range_per_count, count, tmp;
+
+    while (rd->range <= RED_FAST_BOTTOM_VALUE) {
+        rd->low_bound = (rd->low_bound << 8) | ((rd->in_byte << RED_FAST_EXTRA_BITS) & 0xFF);
+        rd->in_byte = (rd->ib_p < rd->ib_end) ? *rd->ib_p++ : 0;
+        rd->low_bound |= rd->in_byte >> (8 - RED_FAST_EXTRA_BITS);
+        rd->range <<= 8;
+    }
+    range_per_count = rd->range / rd->total_counts;
+    count = rd->low_bound / range_per_count;
+    // clamp as RED does: a count at or past the total belongs to the last symbol
+    if (count >= rd->total_counts)
+        count = rd->total_counts - 1;
+
+    // symbol lo satisfies cum_cnts[lo] <= count < cum_cnts[lo + 1]; zero-count symbols are never chosen.  Branch-free
+    // binary search: the symbol is data dependent, so a branch here would mispredict about half the time.
+    lo = 0;
+    for (step = 128; step; step >>= 1)
+        lo += (rd->cum_cnts[lo + step] <= count) ? step : 0;
+
+    tmp = range_per_count * rd->cum_cnts[lo];
+    rd->low_bound -= tmp;
+    // RED narrows on the alphabet position: only symbol 0xFF takes the rest of the range, even when it has a
+    // zero count and the decoded symbol is the highest one in use (flat or zero-valued blocks)
+    if (lo < 0xFF)
+        rd->range = range_per_count * rd->cnts[lo];
+    else
+        rd->range -= tmp;
+    *rd->out++ = (si1) lo;
+    rd->remaining--;
+}
+
+static si4 fast_path_supported(RED_BLOCK_HEADER *block_header)
+{
+    if (block_header->flags & (RED_LEVEL_1_ENCRYPTION_MASK | RED_LEVEL_2_ENCRYPTION_MASK))
+        return(MEF_FALSE);
+    if ((block_header->scale_factor != 0.0 && block_header->scale_factor != 1.0) ||
+        block_header->detrend_slope != 0.0 || block_header->detrend_intercept != 0.0)
+        return(MEF_FALSE);
+    return(MEF_TRUE);
+}
+
+// Self-check on a block the fast path has decoded into rps->decompressed_ptr: the first fast_verify_blocks blocks of
+// the process, and one in fast_verify_interval after that, are decoded again with RED_decode() and compared.  On any
+// difference the block gets RED_decode()'s output and the fast path is switched off for the rest of the process.
+static void verify_block(RED_PROCESSING_STRUCT *rps, si4 kernel)
+{
+    si4 *reference, *samples;
+    ui4 n, interval, n_samples;
+
+    n = atomic_fetch_add(&fast_blocks_decoded, 1);
+    interval = atomic_load(&fast_verify_interval);
+    if (n >= atomic_load(&fast_verify_blocks) && (interval == 0 || n % interval != 0))
+        return;
+
+    samples = rps->decompressed_ptr;
+    n_samples = rps->block_header->number_of_samples;
+    reference = (si4 *) malloc((size_t) n_samples * sizeof(si4) + 1);
+    if (reference == NULL)
+        return;
+    rps->decompressed_ptr = reference;
+    RED_decode(rps);
+    rps->decompressed_ptr = samples;
+    if (memcmp(reference, samples, (size_t) n_samples * sizeof(si4)) != 0) {
+        if (atomic_exchange(&fast_kernel, RED_FAST_KERNEL_MEFLIB) != RED_FAST_KERNEL_MEFLIB)
+            fprintf(stderr, "[%s] %s decode differs from RED_decode(), using RED_decode() from now on\n", __FUNCTION__, RED_decode_fast_kernel_name(kernel));
+        memcpy(samples, reference, (size_t) n_samples * sizeof(si4));
+    }
+    free(reference);
+}
+
+void RED_decode_fast(RED_PROCESSING_STRUCT *rps)
+{
+    si4 kernel;
+    RANGE_DECODER rd;
+
+    kernel = RED_decode_fast_kernel();
+    if (kernel == RED_FAST_KERNEL_MEFLIB || !fast_path_supported(rps->block_header) ||
+        !range_decoder_start(&rd, rps->block_header, rps->difference_buffer)) {
+        RED_decode(rps);
+        return;
+    }
+
+    while (rd.remaining)
+        range_decoder_step(&rd);
+    RED_reconstruct(kernel, rps->difference_buffer, rps->decompressed_ptr, rps->block_header->number_of_samples);
+
+    verify_block(rps, kernel);
+}
+
+// Range decoding is a serial chain of dependent divisions within a block, so RED_FAST_INTERLEAVE blocks are range
+// decoded side by side, one symbol from each in turn, letting the CPU overlap their chains.  Each block gets its own
+// difference buffer; blocks the fast path does not handle go to RED_decode() as they come.
+void RED_decode_fast_blocks(RED_PROCESSING_STRUCT *rps, ui1 **blocks, si4 **samples, si4 n_blocks)
+{
+    si4 i, l, kernel, n_group, active, group[RED_FAST_INTERLEAVE];
+    size_t offset, needed, buffer_bytes;
+    si1 *buffer, *new_buffer;
+    RED_BLOCK_HEADER *block_header;
+    RANGE_DECODER rd[RED_FAST_INTERLEAVE];
+
+    buffer = NULL;
+    buffer_bytes = 0;
+
+    for (i = 0; i < n_blocks;) {
+
+        // collect the next group of blocks the fast path can decode
+        kernel = RED_decode_fast_kernel();
+        n_group = 0;
+        needed = 0;
+        for (; i < n_blocks && n_group < RED_FAST_INTERLEAVE; i++) {
+            block_header = (RED_BLOCK_HEADER *) blocks[i];
+            if (kernel == RED_FAST_KERNEL_MEFLIB || !fast_path_supported(block_header)) {
+                rps->compressed_data = blocks[i];
+                rps->block_header = block_header;
+                rps->decompressed_ptr = samples[i];
+                RED_decode(rps);
+                continue;
+            }
+            group[n_group++] = i;
+            needed += (size_t) block_header->difference_bytes + RED_FAST_PAD_BYTES;
+        }
+        if (n_group == 0)
+            continue;
+
+        if (needed > buffer_bytes) {
+            new_buffer = (si1 *) realloc(buffer, needed);
+            if (new_buffer == NULL) {
+                // no room for separate difference buffers: decode the group one block at a time
+                for (l = 0; l < n_group; l++) {
+                    rps->compressed_data = blocks[group[l]];
+                    rps->block_header = (RED_BLOCK_HEADER *) blocks[group[l]];
+                    rps->decompressed_ptr = samples[group[l]];
+                    RED_decode_fast(rps);
+                }
+                continue;
+            }
+            buffer = new_buffer;
+            buffer_bytes = needed;
+        }
+
+        // a block with no statistics is left to RED_decode(), like in RED_decode_fast()
+        offset = 0;
+        for (l = 0; l < n_group; l++) {
+            block_header = (RED_BLOCK_HEADER *) blocks[group[l]];
+            if (!range_decoder_start(&rd[l], block_header, buffer + offset)) {
+                rps->compressed_data = blocks[group[l]];
+                rps->block_header = block_header;
+                rps->decompressed_ptr = samples[group[l]];
+                RED_decode(rps);
+                rd[l].remaining = 0;
+                rd[l].out = NULL;
+            }
+            offset += (size_t) block_header->difference_bytes + RED_FAST_PAD_BYTES;
+        }
+
+        do {
+            active = 0;
+            for (l = 0; l < n_group; l++) {
+                if (rd[l].remaining) {
+                    range_decoder_step(&rd[l]);
+                    active++;
+                }
+            }
+        } while (active);
+
+        offset = 0;
+        for (l = 0; l < n_group; l++) {
+            block_header = (RED_BLOCK_HEADER *) blocks[group[l]];
+            if (rd[l].out != NULL) {
+                RED_reconstruct(kernel, buffer + offset, samples[group[l]], block_header->number_of_samples);
+                rps->compressed_data = blocks[group[l]];
+                rps->block_header = block_header;
+                rps->decompressed_ptr = samples[group[l]];
+                verify_block(rps, kernel);
+            }
+            offset += (size_t) block_header->difference_bytes + RED_FAST_PAD_BYTES;
+        }
+    }
+
+    free(buffer);
+}
@@ -0,0 +1,56 @@
+/*
+ *  red_decode_fast.h
+ *
+
+ Faster RED block decoding.
+
+ RED_decode_fast() is a drop-in replacement for meflib's RED_decode().  The range decoding stage mirrors RED's; the
+ difference-to-sample reconstruction (running sum plus keysample escape expansion) uses SSE4.1 or AVX2 when the CPU
+ supports them, chosen at run time, with a scalar fallback.  RED_decode_fast_blocks() also range decodes several
+ blocks side by side.  Blocks the fast path does not handle (encrypted, scaled or detrended) are passed to RED_decode().
+ Setting RED_DECODE_KERNEL=meflib sends every block to RED_decode().
+
+ The first RED_FAST_VERIFY_BLOCKS blocks of a process, and one block in RED_FAST_VERIFY_INTERVAL after that, are also
+ decoded with RED_decode() and compared; on any difference the fast path is switched off for the rest of the process.
+ check_red_decode runs the full conformance comparison and should pass before a new meflib or CPU is relied on.
+
+ Copyright 2020, Mayo Foundation, Rochester MN. All rights reserved.
+
+ This software is made freely available under the GNU public license: http://www.gnu.org/licenses/gpl-3.0.txt
+
+ */
+
+#ifndef RED_DECODE_FAST_IN
+#define RED_DECODE_FAST_IN
+
+#include "meflib.h"
+
+#define RED_FAST_VERIFY_BLOCKS      4
+#define RED_FAST_VERIFY_INTERVAL    256
+
+// reconstruction kernels
+#define RED_FAST_KERNEL_MEFLIB      0   // fast path off, RED_decode() only
+#define RED_FAST_KERNEL_SCALAR      1
+#define RED_FAST_KERNEL_SSE41       2
+#define RED_FAST_KERNEL_AVX2        3
+
+// Picks the best kernel for this CPU.  The environment variable RED_DECODE_KERNEL (meflib, scalar, sse4, avx2) overrides
+// the choice.  Called automatically by the first RED_decode_fast(); threaded tools call it before starting workers.
+void    RED_decode_fast_init(void);
+// Forces a kernel; returns MEF_FALSE if it is not available on this CPU or build.
+si4     RED_decode_fast_set_kernel(si4 kernel);
+si4     RED_decode_fast_kernel(void);
+const si1 *RED_decode_fast_kernel_name(si4 kernel);
+// Self-check: the first n_blocks blocks, then one in interval, are cross-checked against RED_decode(); 0, 0 turns it off.
+void    RED_decode_fast_set_verify(si4 n_blocks, si4 interval);
+
+// Same contract as RED_decode(): decodes rps->block_header into rps->decompressed_ptr, using rps->difference_buffer.
+void    RED_decode_fast(RED_PROCESSING_STRUCT *rps);
+// Decodes n_blocks blocks with one kernel dispatch; blocks[i] is decoded into samples[i].
+void    RED_decode_fast_blocks(RED_PROCESSING_STRUCT *rps, ui1 **blocks, si4 **samples, si4 n_blocks);
+
+// Reconstruction stage alone: expands n_samples samples from a RED difference buffer.  Exposed for check_red_decode.
+void    RED_reconstruct_scalar(si1 *differences, si4 *samples, ui4 n_samples);
+void    RED_reconstruct(si4 kernel, si1 *differences, si4 *samples, ui4 n_samples);
+
+#endif